@@ -30,25 +30,112 @@
 
 /* Note unsigned int instead of uint32_t, to make types exactly match
  * Musashi ;(
+ *
+ * Out-of-line slow paths (MMIO, misses, unaligned) are in main.c:
  */
-unsigned int    cpu_read_byte(unsigned int address);
-unsigned int    cpu_read_word(unsigned int address);
-unsigned int    cpu_read_long(unsigned int address);
-void            cpu_write_byte(unsigned int address, unsigned int value);
-void            cpu_write_word(unsigned int address, unsigned int value);
-void            cpu_write_long(unsigned int address, unsigned int value);
+unsigned int    cpu_read_instr_refill(unsigned int address);
+unsigned int    cpu_read_byte_slow(unsigned int address);
+unsigned int    cpu_read_word_slow(unsigned int address);
+unsigned int    cpu_read_long_slow(unsigned int address);
+void            cpu_write_byte_slow(unsigned int address, unsigned int value);
+void            cpu_write_word_slow(unsigned int address, unsigned int value);
+void            cpu_write_long_slow(unsigned int address, unsigned int value);
 void            cpu_pulse_reset(void);
 void            cpu_set_fc(unsigned int fc);
 int             cpu_irq_ack(int level);
 void            cpu_instr_callback(int pc);
+/* Non-zero if cpu_instr_callback() has work to do (trace/profile): */
+extern int      cpu_instr_hook;
+
+/* The memory accessors are inline so that Musashi's opcode handlers
+ * deal with RAM/ROM hits directly via mem_map, and only call out to
+ * main.c for MMIO/misses.  Word/long accesses must be 16-bit aligned
+ * and not cross a page to take the fast path.
+ */
+static inline unsigned int    cpu_read_byte(unsigned int address)
+{
+        uint8_t *p = mem_map[MEM_PAGE(address)].rd;
+
+        if (p)
+                return MEM_RD8(p, address & MEM_PAGE_MASK);
+        return cpu_read_byte_slow(address);
+}
+
+static inline unsigned int    cpu_read_word(unsigned int address)
+{
+        uint8_t *p = mem_map[MEM_PAGE(address)].rd;
 
-extern unsigned int (*cpu_read_instr)(unsigned int address);
+        if (p && !(address & 1))
+                return MEM_RD16_AL(p, address & MEM_PAGE_MASK);
+        return cpu_read_word_slow(address);
+}
+
+static inline unsigned int    cpu_read_long(unsigned int address)
+{
+        uint8_t *p = mem_map[MEM_PAGE(address)].rd;
+
+        if (p && !(address & 1) && (address & MEM_PAGE_MASK) <= (MEM_PAGE_SIZE - 4))
+                return MEM_RD32_AL(p, address & MEM_PAGE_MASK);
+        return cpu_read_long_slow(address);
+}
+
+static inline void    cpu_write_byte(unsigned int address, unsigned int value)
+{
+        uint8_t *p = mem_map[MEM_PAGE(address)].wr;
+
+        if (p)
+                MEM_WR8(p, address & MEM_PAGE_MASK, value);
+        else
+                cpu_write_byte_slow(address, value);
+}
+
+static inline void    cpu_write_word(unsigned int address, unsigned int value)
+{
+        uint8_t *p = mem_map[MEM_PAGE(address)].wr;
+
+        if (p && !(address & 1))
+                MEM_WR16_AL(p, address & MEM_PAGE_MASK, value);
+        else
+                cpu_write_word_slow(address, value);
+}
+
+static inline void    cpu_write_long(unsigned int address, unsigned int value)
+{
+        uint8_t *p = mem_map[MEM_PAGE(address)].wr;
+
+        if (p && !(address & 1) && (address & MEM_PAGE_MASK) <= (MEM_PAGE_SIZE - 4))
+                MEM_WR32_AL(p, address & MEM_PAGE_MASK, value);
+        else
+                cpu_write_long_slow(address, value);
+}
+
+/* Instruction fetch window: a host pointer for the mem_map page
+ * currently being executed from.  Opcode and immediate fetches that
+ * hit it avoid the mem_map lookup entirely; a miss (a jump to another
+ * page) refills it in main.c.  It's invalidated when the memory map
+ * changes (overlay).
+ */
+#define CPU_FETCH_PAGE_NONE     (~0u)
+
+extern unsigned int cpu_fetch_page;
+extern uint8_t *cpu_fetch_host;
 
 /* This is special: an aligned 16b opcode, and will never act on MMIO.
  */
 static inline unsigned int    cpu_read_instr_word(unsigned int address)
 {
-        return cpu_read_instr(address);
+        if (MEM_PAGE(address) == cpu_fetch_page)
+                return MEM_RD16_AL(cpu_fetch_host, address & MEM_PAGE_MASK);
+        return cpu_read_instr_refill(address);
+}
+
+/* Ditto, for 32b immediates (with M68K_SEPARATE_READS): */
+static inline unsigned int    cpu_read_instr_long(unsigned int address)
+{
+        if (MEM_PAGE(address) == cpu_fetch_page &&
+            (address & MEM_PAGE_MASK) <= (MEM_PAGE_SIZE - 4))
+                return MEM_RD32_AL(cpu_fetch_host, address & MEM_PAGE_MASK);
+        return (cpu_read_instr_word(address) << 16) | cpu_read_instr_word(address + 2);
 }
 
 #endif
@@ -26,6 +26,7 @@
 #define DISC_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
 typedef int (*disc_op_read)(void *ctx, uint8_t *data, unsigned int offset, unsigned int len);
 typedef int (*disc_op_write)(void *ctx, uint8_t *data, unsigned int offset, unsigned int len);
@@ -49,4 +50,12 @@ typedef struct {
 void    disc_init(disc_descr_t discs[DISC_NUM_DRIVES]);
 int     disc_pv_hook(uint8_t opcode);
 
+/* Per-instance state, for switching between machines: */
+size_t  disc_state_size(void);
+void    disc_state_save(void *state);
+void    disc_state_load(const void *state);
+/* Re-point the drives at discs, keeping their state, e.g. after loading
+ * a snapshot: */
+void    disc_reattach(disc_descr_t discs[DISC_NUM_DRIVES]);
+
 #endif
@@ -74,7 +74,7 @@
  * and m68k_read_pcrelative_xx() for PC-relative addressing.
  * If off, all read requests from the CPU will be redirected to m68k_read_xx()
  */
-#define M68K_SEPARATE_READS         OPT_OFF
+#define M68K_SEPARATE_READS         OPT_ON
 
 /* If ON, the CPU will call m68k_write_32_pd() when it executes move.l with a
  * predecrement destination EA mode instead of m68k_write_32().
@@ -161,8 +161,11 @@
  * instruction.
  */
 #ifdef ENABLE_DASM
+/* Tracing/profiling are normally off, so test the flag inline rather
+ * than calling out for every instruction:
+ */
 #define M68K_INSTRUCTION_HOOK       OPT_SPECIFY_HANDLER
-#define M68K_INSTRUCTION_CALLBACK(pc) cpu_instr_callback(pc)
+#define M68K_INSTRUCTION_CALLBACK(pc) do { if (cpu_instr_hook) cpu_instr_callback(pc); } while (0)
 #else
 #define M68K_INSTRUCTION_HOOK       OPT_OFF
 #endif
@@ -198,7 +201,11 @@
  * version adds 256KB to the binary and no RAM, but doesn't currently
  * support instruction cycle counts.
  */
+#if UMAC_CYCLE_COUNTING
+#define M68K_DYNAMIC_INSTR_TABLES   OPT_ON
+#else
 #define M68K_DYNAMIC_INSTR_TABLES   OPT_OFF
+#endif
 
 /* Count instruction cycles.  This costs a table (created at runtime
  * in RAM if DYNAMIC_INSTR_TABLES is on).
@@ -206,7 +213,11 @@
  * NOTE: This is not currently supported when DYNAMIC_INSTR_TABLES is
  * off.
  */
+#if UMAC_CYCLE_COUNTING
+#define M68K_CYCLE_COUNTING         OPT_ON
+#else
 #define M68K_CYCLE_COUNTING         OPT_OFF
+#endif
 
 #define M68K_FIXED_CPU_TYPE         CPU_TYPE_000
 
@@ -231,6 +242,15 @@
 #define m68k_read_memory_32(A) cpu_read_long(A)
 #define m68k_read_instr_16(A) cpu_read_instr_word(A)
 
+/* Immediates come from the instruction stream, so use the fetch window.
+ * PC-relative operands are regular data reads:
+ */
+#define m68k_read_immediate_16(A) cpu_read_instr_word(A)
+#define m68k_read_immediate_32(A) cpu_read_instr_long(A)
+#define m68k_read_pcrelative_8(A) cpu_read_byte(A)
+#define m68k_read_pcrelative_16(A) cpu_read_word(A)
+#define m68k_read_pcrelative_32(A) cpu_read_long(A)
+
 #define m68k_read_disassembler_16(A) cpu_read_word_dasm(A)
 #define m68k_read_disassembler_32(A) cpu_read_long_dasm(A)
 
@@ -241,6 +261,12 @@
 #ifdef PICO
 #include "pico.h"
 #define M68K_FAST_FUNC(x)       __not_in_flash_func(x)
+#elif defined(__linux__) && defined(__GNUC__)
+/* Gather hot handlers into .text.hot.*, which the stock GNU ld script
+ * places together at the start of .text: keeps them dense in the host
+ * i-cache/iTLB rather than scattered through m68kops.o.
+ */
+#define M68K_FAST_FUNC(x)       __attribute__((section(".text.hot." #x))) x
 #endif
 
 #endif /* M68K_COMPILE_FOR_MAME */
@@ -28,6 +28,7 @@
 #ifndef MACHW_H
 #define MACHW_H
 
+#include <string.h>
 #include "rom.h"
 
 #define ROM_ADDR        0x400000        /* Regular base (and 0, when overlay=0 */
@@ -89,6 +90,49 @@ extern int overlay;
 #define IS_DUMMY(x)     (((ADR24(x) >= 0x800000) && (ADR24(x) < 0x9ffff8)) || ((ADR24(x) & 0xf00000) == 0x500000))
 #define IS_TESTSW(x)    (ADR24(x) >= 0xf00000)
 
+/* Memory map:
+ *
+ * The 24-bit bus is split into 256 64KB pages, each of which has a
+ * host pointer for reads (RAM or ROM) and one for writes (RAM only).
+ * A NULL pointer means the page is I/O (or unmapped), and accesses
+ * fall through to the device decode in main.c.  This makes the common
+ * RAM/ROM case a lookup plus a load, without re-testing overlay on
+ * every access.
+ *
+ * RAM mirroring (CLAMP_RAM_ADDR) is baked in: a page gets a direct
+ * pointer only if it maps to a contiguous 64KB of RAM.  For non-Po2
+ * sizes (e.g. a 208K Mac) the page straddling the end of RAM is left
+ * NULL, and the slow path deals with the wrap.
+ */
+#define MEM_PAGE_SHIFT          16
+#define MEM_PAGE_SIZE           (1 << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK           (MEM_PAGE_SIZE - 1)
+#define MEM_NUM_PAGES           (0x1000000 >> MEM_PAGE_SHIFT)
+#define MEM_PAGE(x)             (ADR24(x) >> MEM_PAGE_SHIFT)
+
+struct mem_page {
+        uint8_t *rd;
+        uint8_t *wr;
+};
+
+extern struct mem_page mem_map[MEM_NUM_PAGES];
+
+
+/* 68000 longs are only 16-bit aligned, so go via memcpy (which becomes
+ * a single load/store where the host allows):
+ */
+static inline uint32_t read_be32_al(const uint8_t *p)
+{
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return __builtin_bswap32(v);
+}
+
+static inline void write_be32_al(uint8_t *p, uint32_t val)
+{
+        uint32_t v = __builtin_bswap32(val);
+        memcpy(p, &v, 4);
+}
 
 /* Unaligned/BE read/write macros from Mushashi: */
 #define READ_BYTE(BASE, ADDR)           (BASE)[ADDR]
@@ -99,6 +143,7 @@ extern int overlay;
                                          ((BASE)[(ADDR)+2]<<8) |        \
                                          (BASE)[(ADDR)+3])
 #define READ_WORD_AL(BASE, ADDR)         (__builtin_bswap16(*(uint16_t *)&(BASE)[(ADDR)]))
+#define READ_LONG_AL(BASE, ADDR)         (read_be32_al(&(BASE)[(ADDR)]))
 
 #define WRITE_BYTE(BASE, ADDR, VAL)     do { \
                 (BASE)[ADDR] = (VAL)&0xff;   \
@@ -113,21 +158,128 @@ extern int overlay;
                 (BASE)[(ADDR)+2] = ((VAL)>>8)&0xff;                     \
                 (BASE)[(ADDR)+3] = (VAL)&0xff;                          \
         } while(0)
+#define WRITE_WORD_AL(BASE, ADDR, VAL)  do {                            \
+                *(uint16_t *)&(BASE)[(ADDR)] = __builtin_bswap16(VAL);  \
+        } while(0)
+#define WRITE_LONG_AL(BASE, ADDR, VAL)  write_be32_al(&(BASE)[(ADDR)], VAL)
+
+/* Guest memory layout:
+ *
+ * By default RAM and ROM hold the Mac's big-endian byte stream as-is.
+ * With UMAC_RAM_SWIZZLE, they're instead held as 16-bit words in host
+ * (little-endian) order, i.e. Mac byte address A lives at host offset
+ * A^1.  Aligned word accesses then become plain loads/stores, and longs
+ * a load plus a rotate; only byte accesses need the address fixup.
+ * umac_init() converts the ROM image in place, so it must be writable.
+ *
+ * Anything outside the CPU that touches RAM directly (framebuffer,
+ * disc transfers) must use MEM_BYTE_ADDR() or ram_copy_{in,out}().
+ */
+#if UMAC_RAM_SWIZZLE
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "UMAC_RAM_SWIZZLE needs a little-endian host"
+#endif
+
+static inline uint32_t read_swz32_al(const uint8_t *p)
+{
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return (v << 16) | (v >> 16);
+}
+
+static inline void write_swz32_al(uint8_t *p, uint32_t val)
+{
+        uint32_t v = (val << 16) | (val >> 16);
+        memcpy(p, &v, 4);
+}
+
+#define MEM_BYTE_ADDR(x)                ((x) ^ 1)
+
+#define MEM_RD8(BASE, ADDR)             READ_BYTE(BASE, MEM_BYTE_ADDR(ADDR))
+#define MEM_RD16(BASE, ADDR)            ((MEM_RD8(BASE, ADDR) << 8) |   \
+                                         MEM_RD8(BASE, (ADDR)+1))
+#define MEM_RD32(BASE, ADDR)            (((uint32_t)MEM_RD16(BASE, ADDR) << 16) | \
+                                         MEM_RD16(BASE, (ADDR)+2))
+#define MEM_RD16_AL(BASE, ADDR)         (*(uint16_t *)&(BASE)[(ADDR)])
+#define MEM_RD32_AL(BASE, ADDR)         (read_swz32_al(&(BASE)[(ADDR)]))
+
+#define MEM_WR8(BASE, ADDR, VAL)        WRITE_BYTE(BASE, MEM_BYTE_ADDR(ADDR), VAL)
+#define MEM_WR16(BASE, ADDR, VAL)       do {                            \
+                MEM_WR8(BASE, ADDR, (VAL)>>8);                          \
+                MEM_WR8(BASE, (ADDR)+1, VAL);                           \
+        } while(0)
+#define MEM_WR32(BASE, ADDR, VAL)       do {                            \
+                MEM_WR16(BASE, ADDR, (VAL)>>16);                        \
+                MEM_WR16(BASE, (ADDR)+2, VAL);                          \
+        } while(0)
+#define MEM_WR16_AL(BASE, ADDR, VAL)    do {                            \
+                *(uint16_t *)&(BASE)[(ADDR)] = (VAL);                   \
+        } while(0)
+#define MEM_WR32_AL(BASE, ADDR, VAL)    write_swz32_al(&(BASE)[(ADDR)], VAL)
+#else
+#define MEM_BYTE_ADDR(x)                (x)
+
+#define MEM_RD8(BASE, ADDR)             READ_BYTE(BASE, ADDR)
+#define MEM_RD16(BASE, ADDR)            READ_WORD(BASE, ADDR)
+#define MEM_RD32(BASE, ADDR)            READ_LONG(BASE, ADDR)
+#define MEM_RD16_AL(BASE, ADDR)         READ_WORD_AL(BASE, ADDR)
+#define MEM_RD32_AL(BASE, ADDR)         READ_LONG_AL(BASE, ADDR)
+
+#define MEM_WR8(BASE, ADDR, VAL)        WRITE_BYTE(BASE, ADDR, VAL)
+#define MEM_WR16(BASE, ADDR, VAL)       WRITE_WORD(BASE, ADDR, VAL)
+#define MEM_WR32(BASE, ADDR, VAL)       WRITE_LONG(BASE, ADDR, VAL)
+#define MEM_WR16_AL(BASE, ADDR, VAL)    WRITE_WORD_AL(BASE, ADDR, VAL)
+#define MEM_WR32_AL(BASE, ADDR, VAL)    WRITE_LONG_AL(BASE, ADDR, VAL)
+#endif
 
 /* Specific RAM/ROM access: */
 
-#define RAM_RD8(addr)                   READ_BYTE(_ram_base, addr)
-#define RAM_RD16(addr)                  READ_WORD(_ram_base, addr)
-#define RAM_RD_ALIGNED_BE16(addr)       READ_WORD_AL(_ram_base, addr)
-#define RAM_RD32(addr)                  READ_LONG(_ram_base, addr)
+#define RAM_RD8(addr)                   MEM_RD8(_ram_base, addr)
+#define RAM_RD16(addr)                  MEM_RD16(_ram_base, addr)
+#define RAM_RD_ALIGNED_BE16(addr)       MEM_RD16_AL(_ram_base, addr)
+#define RAM_RD32(addr)                  MEM_RD32(_ram_base, addr)
+
+#define RAM_WR8(addr, val)              MEM_WR8(_ram_base, addr, val)
+#define RAM_WR16(addr, val)             MEM_WR16(_ram_base, addr, val)
+#define RAM_WR32(addr, val)             MEM_WR32(_ram_base, addr, val)
 
-#define RAM_WR8(addr, val)              WRITE_BYTE(_ram_base, addr, val)
-#define RAM_WR16(addr, val)             WRITE_WORD(_ram_base, addr, val)
-#define RAM_WR32(addr, val)             WRITE_LONG(_ram_base, addr, val)
+#define ROM_RD8(addr)                   MEM_RD8(_rom_base, addr)
+#define ROM_RD16(addr)                  MEM_RD16(_rom_base, addr)
+#define ROM_RD_ALIGNED_BE16(addr)       MEM_RD16_AL(_rom_base, addr)
+#define ROM_RD32(addr)                  MEM_RD32(_rom_base, addr)
+
+/* Copy a big-endian byte stream into/out of RAM at offset addr: */
+static inline void ram_copy_in(unsigned int addr, const uint8_t *src, size_t len)
+{
+#if UMAC_RAM_SWIZZLE
+        size_t i = 0;
+        if (!(addr & 1)) {
+                for (; i + 1 < len; i += 2)
+                        MEM_WR16_AL(_ram_base, addr + i, (src[i] << 8) | src[i + 1]);
+        }
+        for (; i < len; i++)
+                RAM_WR8(addr + i, src[i]);
+#else
+        memcpy(_ram_base + addr, src, len);
+#endif
+}
 
-#define ROM_RD8(addr)                   READ_BYTE(_rom_base, addr)
-#define ROM_RD16(addr)                  READ_WORD(_rom_base, addr)
-#define ROM_RD_ALIGNED_BE16(addr)       READ_WORD_AL(_rom_base, addr)
-#define ROM_RD32(addr)                  READ_LONG(_rom_base, addr)
+static inline void ram_copy_out(uint8_t *dst, unsigned int addr, size_t len)
+{
+#if UMAC_RAM_SWIZZLE
+        size_t i = 0;
+        if (!(addr & 1)) {
+                for (; i + 1 < len; i += 2) {
+                        uint16_t v = MEM_RD16_AL(_ram_base, addr + i);
+                        dst[i] = v >> 8;
+                        dst[i + 1] = v & 0xff;
+                }
+        }
+        for (; i < len; i++)
+                dst[i] = RAM_RD8(addr + i);
+#else
+        memcpy(dst, _ram_base + addr, len);
+#endif
+}
 
 #endif
@@ -0,0 +1,62 @@
+/*
+ * Input recording and replay
+ *
+ * Copyright 2024 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <inttypes.h>
+
+/* Record everything passed to the replay_*() wrappers below, from a
+ * freshly initialised machine.  Returns 0 on success.
+ */
+int     replay_record(const char *filename);
+/* Play back a recording, on a machine set up the same way as when it
+ * was recorded (ROM, disc, build options, umac_opt_*()).
+ */
+int     replay_open(const char *filename);
+void    replay_close(void);
+
+/* Use these in place of the umac_*() calls.  When recording, they're
+ * logged (against emulated time) as well as passed on:
+ */
+void    replay_kbd_event(uint8_t scancode, int down);
+void    replay_mouse(int deltax, int deltay, int button);
+void    replay_vsync_event(void);
+void    replay_1hz_event(void);
+int     replay_run_until(uint64_t budget_us, unsigned int stop_on, uint64_t *elapsed_us);
+int     replay_loop(void);
+
+/* When playing back, this replaces all of the above: it delivers the
+ * recorded input up to and including the next run, and puts the
+ * run's UMAC_RUN_x result in *run_result.
+ */
+#define REPLAY_OK               0
+#define REPLAY_END              1       /* Recording finished */
+#define REPLAY_DIVERGED         2       /* State doesn't match recording */
+#define REPLAY_BAD              3       /* Corrupt recording */
+int     replay_step(int *run_result);
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ * Rewind buffer: a ring of recent machine states
+ *
+ * Copyright 2024 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/* Keep up to max_points states of the current machine (call after
+ * umac_init()).  The oldest point is the base the others apply to, so
+ * max_points must be at least 2.  Returns 0, or -1 on failure.
+ */
+int             rewind_init(unsigned int max_points);
+void            rewind_free(void);
+/* Add a point for the current state, dropping the oldest if full.
+ * Call between runs, e.g. every N frames.
+ */
+int             rewind_capture(void);
+unsigned int    rewind_num_points(void);
+/* Go back to the point 'back' captures ago (0 being the latest),
+ * discarding any later points.  Disc contents aren't rewound.
+ */
+int             rewind_restore(unsigned int back);
+/* Go back to the latest point captured at or before time_us (emulated
+ * time), e.g. the last one before something went wrong.
+ */
+int             rewind_restore_to(uint64_t time_us);
+/* Memory used for RAM contents of points, in bytes */
+size_t          rewind_mem_used(void);
+
+#endif
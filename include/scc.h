@@ -28,6 +28,8 @@
 /* Callbacks for various SCC events: */
 struct scc_cb {
         void (*irq_set)(int status);
+        /* RR0 status (DCD) changed, whether or not it raises an IRQ: */
+        void (*status_change)(void);
 };
 
 void    scc_init(struct scc_cb *cb);
@@ -36,5 +38,10 @@ uint8_t scc_read(unsigned int address);
 /* Set a new state for the DCD pins: */
 void    scc_set_dcd(int a, int b);
 
+/* Per-instance state, for switching between machines: */
+size_t  scc_state_size(void);
+void    scc_state_save(void *state);
+void    scc_state_load(const void *state);
+
 #endif
 
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2024 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define SCHED_NEVER     (~(uint64_t)0)
+
+/* Each source of timed events has a fixed slot, holding at most one
+ * pending deadline:
+ */
+enum {
+        SCHED_EVT_KBD = 0,
+        SCHED_EVT_MOUSE,
+        SCHED_EVT_VIA_T1,
+        SCHED_EVT_VIA_T2,
+        SCHED_EVT_VBL,
+        SCHED_EVT_1HZ,
+        SCHED_NUM_EVTS
+};
+
+typedef void (*sched_fn_t)(void);
+
+struct sched_cb {
+        /* Current emulated time, in us (even mid-way through a CPU slice) */
+        uint64_t (*now)(void);
+        /* An event has been posted for the given time: */
+        void (*deadline)(uint64_t time);
+};
+
+void            sched_init(struct sched_cb *cb);
+void            sched_register(int evt, sched_fn_t fn);
+/* Current emulated time, in us: */
+uint64_t        sched_time(void);
+/* Post evt to fire delay_us from now, replacing any pending deadline: */
+void            sched_post(int evt, uint64_t delay_us);
+/* Post evt to fire at an absolute time (as per sched_time()): */
+void            sched_post_at(int evt, uint64_t time);
+void            sched_cancel(int evt);
+int             sched_pending(int evt);
+/* Time of the earliest pending event, or SCHED_NEVER: */
+uint64_t        sched_next(void);
+/* Fire all events due at or before time: */
+void            sched_run(uint64_t time);
+
+/* Per-instance state, for switching between machines: */
+size_t          sched_state_size(void);
+void            sched_state_save(void *state);
+void            sched_state_load(const void *state);
+
+#endif
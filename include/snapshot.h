@@ -0,0 +1,56 @@
+/*
+ * Snapshot files: machine state, RAM and modified disc blocks
+ *
+ * Copyright 2024 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "disc.h"
+
+/* Save the current machine to filename.  Disc blocks differing from
+ * the image in disc_fd (e.g. writes to a MAP_PRIVATE mapping of it) are
+ * saved too; pass -1 if there's no disc.  The disc mapping mustn't be
+ * shared with disc_fd, or nothing will ever differ.  Returns 0 on
+ * success.
+ */
+int     snapshot_write(const char *filename, disc_descr_t *disc, int disc_fd);
+
+/* Restore the machine from filename, instead of umac_init().  discs[]
+ * should hold the same images as when saved; any saved modified blocks
+ * are written back into discs[0].base.  RAM is mapped from the file
+ * copy-on-write, so pages are only read in when touched.  Returns the
+ * new RAM base, or NULL on failure.
+ */
+void    *snapshot_restore(const char *filename, void *rom_base,
+                          disc_descr_t discs[DISC_NUM_DRIVES]);
+
+/* Load filename into the current machine in place, e.g. to go back to
+ * a known-good state.  RAM is read in, and the disc re-read from
+ * disc_fd (its image) before applying the saved blocks.  Returns 0 on
+ * success.
+ */
+int     snapshot_load(const char *filename, disc_descr_t *disc, int disc_fd);
+
+#endif
@@ -29,24 +29,101 @@
 #include "via.h"
 #include "machw.h"
 
+/* Several machines can be run by one process, one at a time: all
+ * other calls act on the machine last passed to umac_select().  Without
+ * these, there's a single implicit machine.
+ */
+typedef struct umac umac_t;
+umac_t  *umac_new(void);
+void    umac_free(umac_t *u);
+void    umac_select(umac_t *u);
+
 int     umac_init(void *_ram_base, void *_rom_base, disc_descr_t discs[DISC_NUM_DRIVES]);
 int     umac_loop(void);
+#define UMAC_EXECLOOP_QUANTUM   5000    /* umac_loop()'s run, in us */
+
+/* Snapshots of the machine state, not including RAM, ROM or disc
+ * contents, which the caller saves alongside (see snapshot.h).  Call
+ * between runs, not from within umac_run_until().  Restoring is instead
+ * of umac_init(), with RAM/discs holding the contents as of the save;
+ * it fails (returning -1) for a snapshot from an incompatible build.
+ */
+size_t  umac_snapshot_size(void);
+void    umac_snapshot_save(void *buf);
+/* Returns -1 if buf can't be restored/loaded into this build, else 0 */
+int     umac_snapshot_check(const void *buf);
+int     umac_snapshot_restore(const void *buf, void *ram_base, void *rom_base,
+                              disc_descr_t discs[DISC_NUM_DRIVES]);
+/* Load a snapshot into the current machine, keeping its RAM/ROM/disc
+ * (whose contents are the caller's business): */
+int     umac_snapshot_load(const void *buf);
+
+/* RAM dirty tracking, in pages of MEM_PAGE_SIZE (see machw.h).  Once
+ * enabled, umac_ram_dirty_collect() sets dirty[n] for each page of RAM
+ * that's been written (by the CPU or disc) since the last call.
+ */
+#define UMAC_RAM_NUM_PAGES      ((RAM_SIZE + MEM_PAGE_SIZE - 1) >> MEM_PAGE_SHIFT)
+void    umac_opt_track_dirty(int enable);
+void    umac_ram_dirty_collect(uint8_t dirty[UMAC_RAM_NUM_PAGES]);
+
+/* umac_run_until() exit reasons.  Pass a mask of UMAC_STOP_ON(reason)
+ * for the events that should end a run early:
+ */
+#define UMAC_RUN_BUDGET         0       /* Ran for the whole budget */
+#define UMAC_RUN_DONE           1       /* Emulation finished (e.g. error) */
+#define UMAC_RUN_FB             2       /* Guest wrote to the framebuffer */
+#define UMAC_RUN_VBL            3       /* Vsync interrupt raised */
+#define UMAC_RUN_IDLE           4       /* Guest went idle */
+#define UMAC_RUN_DISC           5       /* A disc operation completed */
+#define UMAC_RUN_BREAKPOINT     6       /* See umac_breakpoint_set() */
+#define UMAC_RUN_WATCHDOG       7       /* See umac_watchdog_get() */
+#define UMAC_STOP_ON(r)         (1U << (r))
+int     umac_run_until(uint64_t budget_us, unsigned int stop_on, uint64_t *elapsed_us);
+int     umac_breakpoint_set(uint32_t pc);
+void    umac_breakpoint_clear(uint32_t pc);
 void    umac_reset(void);
 void    umac_opt_disassemble(int enable);
+void    umac_opt_profile(int enable);
+void    umac_opt_internal_timing(int enable);
+void    umac_opt_watchdog(unsigned int stall_s);
+void    umac_profile_dump(FILE *f);
+void    umac_profile_dump_ops(FILE *f);
 void    umac_mouse(int deltax, int deltay, int button);
 void    umac_kbd_event(uint8_t scancode, int down);
 
-static inline void      umac_vsync_event(void)
-{
-        via_caX_event(2);
-}
+void    umac_vsync_event(void);
+void    umac_1hz_event(void);
 
-static inline void      umac_1hz_event(void)
-{
-        via_caX_event(1);
-}
+/* Watchdog events, for a guest that's crashed or hung (see
+ * umac_opt_watchdog()).  An event ends a run given UMAC_RUN_WATCHDOG
+ * in its mask, and keeps doing so until it's collected.
+ */
+#define UMAC_WD_NONE            0
+#define UMAC_WD_EXIT_ERROR      1       /* Emulation stopped, see msg */
+#define UMAC_WD_SYSERROR        2       /* System Error (bomb box), see code */
+#define UMAC_WD_STALL           3       /* No VBL progress, e.g. Sad Mac */
+typedef struct {
+        int reason;
+        int code;               /* SysError ID */
+        uint64_t time_us;       /* When noticed */
+        uint64_t since_us;      /* Fine until about here */
+        uint32_t pc;
+        uint32_t sr;
+        uint32_t d[8];
+        uint32_t a[8];
+        char msg[128];
+} umac_watchdog_t;
+int     umac_watchdog_get(umac_watchdog_t *w);
+void    umac_watchdog_describe(const umac_watchdog_t *w, char *buf, size_t len);
+
+#define UMAC_IDLE_FOREVER       (~(uint64_t)0)
+uint64_t umac_idle_until(void);
+uint64_t umac_get_time_us(void);
 
-/* Return the offset into RAM of the current display buffer */
+/* Return the offset into RAM of the current display buffer.
+ * Note that for UMAC_RAM_SWIZZLE builds, bytes must be fetched at
+ * MEM_BYTE_ADDR(offset) (see machw.h).
+ */
 static inline unsigned int      umac_get_fb_offset(void)
 {
         /* FIXME: Implement VIA RA6/vid.pg2 */
@@ -35,14 +35,22 @@ struct via_cb {
         uint8_t (*rb_in)(void);
         void (*sr_tx)(uint8_t val);
         void (*irq_set)(int status);
+        /* Any IFR bits being set, whether or not they're enabled: */
+        void (*ifr_set)(uint8_t flags);
 };
 
 void    via_init(struct via_cb *cb);
 void    via_write(unsigned int address, uint8_t data);
 uint8_t via_read(unsigned int address);
-void    via_tick(uint64_t time);
 /* Trigger an event on CA1 or CA2: */
 void    via_caX_event(int ca);
 void    via_sr_rx(uint8_t val);
+/* Current state of the IRQ output: */
+int     via_irq_status(void);
+
+/* Per-instance state, for switching between machines: */
+size_t  via_state_size(void);
+void    via_state_save(void *state);
+void    via_state_load(const void *state);
 
 #endif
@@ -0,0 +1,727 @@
+/* umac headless batch runner
+ *
+ * Runs a manifest of jobs (ROM, optional disc, optional input script,
+ * emulated time limit), one headless machine per job, on a pool of
+ * worker processes sized to the host's cores.  Writes one result line
+ * per job.
+ *
+ * Musashi's CPU state is global, so one process can only run one
+ * machine at a time; workers are forked processes, each running jobs
+ * back-to-back through umac_init()/umac_run_until().  Jobs are handed
+ * out dynamically from a shared counter, so a worker that finishes
+ * early just takes the next job.
+ *
+ * Copyright 2024 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rom.h"
+#include "umac.h"
+#include "machw.h"
+#include "disc.h"
+
+static void     print_help(char *n)
+{
+        printf("Syntax: %s <options> <manifest>\n"
+               "\t-b <seconds>\t\tBoot each ROM/disc once for this long, and fork\n"
+               "\t\t\t\tjobs from it (script times count from there)\n"
+               "\t-g <seconds>\t\tCall a job hung after no VBL progress for this\n"
+               "\t\t\t\tlong (default 10, 0 never; System Errors are\n"
+               "\t\t\t\tcrashes regardless)\n"
+               "\t-j <jobs>\t\tWorker processes (default: number of CPUs)\n"
+               "\t-l <seconds>\t\tDefault emulated time limit per job (default 60)\n"
+               "\t-o <results path>\tWrite results here (default stdout)\n"
+               "\n"
+               "Manifest lines are: <name> <rom> [<disc> [<script> [<limit>]]]\n"
+               "using '-' to skip a field.  Script lines are <ms> <command>:\n"
+               "\tkey <mac keycode> <1=down|0=up>\n"
+               "\tmouse <dx> <dy> <button>\n"
+               "\tcheck-fb <hash>\t\tFail unless the screen matches\n"
+               "\tend\t\t\tPass\n", n);
+}
+
+#define JOB_DEFAULT_LIMIT_S     60
+#define JOB_DEFAULT_WATCHDOG_S  10
+
+typedef struct {
+        char *name;
+        char *rom;
+        char *disc;
+        char *script;
+        double limit_s;
+} job_t;
+
+#define RES_PENDING             0
+#define RES_RUNNING             1
+#define RES_DONE                2
+
+/* Job results, shared between the workers and parent: */
+typedef struct {
+        int state;
+        pid_t worker;
+        int status;
+        uint64_t emu_us;
+        uint64_t host_us;
+        uint32_t fb_hash;
+        char detail[96];
+} result_t;
+
+enum { ST_CRASH = 0, ST_PASS, ST_FAIL, ST_TIMEOUT, ST_ERROR, ST_HANG };
+static const char *status_names[] = { "crash", "pass", "fail", "timeout", "error", "hang" };
+
+static job_t *jobs;
+static int num_jobs;
+static result_t *results;
+static int *next_job;
+static unsigned int watchdog_s = JOB_DEFAULT_WATCHDOG_S;
+
+static uint64_t get_usec(void)
+{
+        struct timeval tv_now;
+
+        gettimeofday(&tv_now, NULL);
+        return (tv_now.tv_sec * 1000000) + tv_now.tv_usec;
+}
+
+/**********************************************************************/
+// Manifest
+
+static char     *field(char *s)
+{
+        if (!s || !strcmp(s, "-"))
+                return NULL;
+        return strdup(s);
+}
+
+static int      manifest_load(const char *filename, double default_limit)
+{
+        FILE *f = fopen(filename, "r");
+        char line[1024];
+        int lineno = 0;
+        int cap = 0;
+
+        if (!f) {
+                perror("Manifest");
+                return -1;
+        }
+        while (fgets(line, sizeof(line), f)) {
+                char *name, *rom, *disc, *script, *limit;
+
+                lineno++;
+                name = strtok(line, " \t\r\n");
+                if (!name || name[0] == '#')
+                        continue;
+                rom = strtok(NULL, " \t\r\n");
+                disc = strtok(NULL, " \t\r\n");
+                script = strtok(NULL, " \t\r\n");
+                limit = strtok(NULL, " \t\r\n");
+                if (!rom) {
+                        fprintf(stderr, "%s:%d: No ROM given\n", filename, lineno);
+                        fclose(f);
+                        return -1;
+                }
+
+                if (num_jobs == cap) {
+                        cap = cap ? cap * 2 : 64;
+                        jobs = realloc(jobs, cap * sizeof(job_t));
+                        if (!jobs) {
+                                fclose(f);
+                                return -1;
+                        }
+                }
+                job_t *j = &jobs[num_jobs++];
+                j->name = strdup(name);
+                j->rom = strdup(rom);
+                j->disc = field(disc);
+                j->script = field(script);
+                j->limit_s = (limit && strcmp(limit, "-")) ? atof(limit) : default_limit;
+        }
+        fclose(f);
+        return 0;
+}
+
+/**********************************************************************/
+// Running a job (in a worker)
+
+/* Patched ROM, cached as consecutive jobs usually share one.  umac_init()
+ * can modify the ROM it's given, so each job gets a fresh copy.
+ */
+static char *rom_cached_name = NULL;
+static uint8_t rom_cached[ROM_SIZE];
+static uint8_t rom_buf[ROM_SIZE];
+static uint8_t *ram_buf;
+
+static int      rom_load(const char *filename, result_t *r)
+{
+        if (!rom_cached_name || strcmp(rom_cached_name, filename)) {
+                free(rom_cached_name);
+                rom_cached_name = NULL;
+
+                FILE *f = fopen(filename, "rb");
+                if (!f || fread(rom_cached, 1, ROM_SIZE, f) != ROM_SIZE) {
+                        snprintf(r->detail, sizeof(r->detail), "Can't read ROM %s", filename);
+                        if (f)
+                                fclose(f);
+                        return -1;
+                }
+                fclose(f);
+                if (rom_patch(rom_cached)) {
+                        snprintf(r->detail, sizeof(r->detail), "Failed to patch ROM %s", filename);
+                        return -1;
+                }
+                rom_cached_name = strdup(filename);
+        }
+        memcpy(rom_buf, rom_cached, ROM_SIZE);
+        return 0;
+}
+
+/* FNV-1a over the (unswizzled) framebuffer */
+static uint32_t fb_hash(void)
+{
+        uint8_t *fb = ram_get_base() + umac_get_fb_offset();
+        uint32_t h = 2166136261u;
+
+        for (unsigned int i = 0; i < DISP_WIDTH * DISP_HEIGHT / 8; i++) {
+                h ^= fb[MEM_BYTE_ADDR(i)];
+                h *= 16777619u;
+        }
+        return h;
+}
+
+/* Run the script command in line, returning 1 if the job's finished */
+static int      script_cmd(char *line, int lineno, result_t *r)
+{
+        char *cmd = line ? strtok(line, " \t\r\n") : NULL;
+        char *a = cmd ? strtok(NULL, " \t\r\n") : NULL;
+        char *b = a ? strtok(NULL, " \t\r\n") : NULL;
+        char *c = b ? strtok(NULL, " \t\r\n") : NULL;
+
+        if (!cmd) {
+                r->status = ST_ERROR;
+                snprintf(r->detail, sizeof(r->detail), "line %d: no command", lineno);
+                return 1;
+        } else if (!strcmp(cmd, "key") && a && b) {
+                umac_kbd_event((strtoul(a, NULL, 0) << 1) | 1, atoi(b));
+        } else if (!strcmp(cmd, "mouse") && a && b && c) {
+                umac_mouse(atoi(a), atoi(b), atoi(c));
+        } else if (!strcmp(cmd, "check-fb") && a) {
+                uint32_t want = strtoul(a, NULL, 16);
+                uint32_t got = fb_hash();
+                if (got != want) {
+                        r->status = ST_FAIL;
+                        snprintf(r->detail, sizeof(r->detail),
+                                 "line %d: fb %08x, expected %08x", lineno, got, want);
+                        return 1;
+                }
+        } else if (!strcmp(cmd, "end")) {
+                r->status = ST_PASS;
+                return 1;
+        } else {
+                r->status = ST_ERROR;
+                snprintf(r->detail, sizeof(r->detail), "line %d: bad command", lineno);
+                return 1;
+        }
+        return 0;
+}
+
+/* Disc mapping for the machine in this process */
+static void *disc_base = NULL;
+static size_t disc_size = 0;
+
+/* Set up a fresh machine with j's ROM and disc */
+static int      machine_start(job_t *j, result_t *r)
+{
+        disc_descr_t discs[DISC_NUM_DRIVES] = {0};
+
+        if (rom_load(j->rom, r))
+                return -1;
+
+        if (j->disc) {
+                int fd = open(j->disc, O_RDONLY);
+                struct stat sb;
+
+                if (fd < 0 || fstat(fd, &sb)) {
+                        snprintf(r->detail, sizeof(r->detail), "Can't open disc %s", j->disc);
+                        if (fd >= 0)
+                                close(fd);
+                        return -1;
+                }
+                /* Private copy: the guest's writes are discarded */
+                disc_size = sb.st_size;
+                disc_base = mmap(0, disc_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                close(fd);
+                if (disc_base == MAP_FAILED) {
+                        disc_base = NULL;
+                        snprintf(r->detail, sizeof(r->detail), "Can't mmap disc %s", j->disc);
+                        return -1;
+                }
+                discs[0].base = disc_base;
+                discs[0].size = disc_size;
+        }
+
+        memset(ram_buf, 0, RAM_SIZE);
+        umac_init(ram_buf, rom_buf, discs);
+        umac_opt_internal_timing(1);
+        umac_opt_watchdog(watchdog_s);
+        return 0;
+}
+
+/* Runs end early if the guest crashes or hangs, so it doesn't tie up
+ * a worker until the time limit:
+ */
+#define RUN_STOP_ON             UMAC_STOP_ON(UMAC_RUN_WATCHDOG)
+
+/* A run ended with UMAC_RUN_DONE/UMAC_RUN_WATCHDOG: say why in r */
+static void     machine_died(result_t *r)
+{
+        umac_watchdog_t w;
+
+        if (umac_watchdog_get(&w) == UMAC_WD_NONE) {
+                r->status = ST_ERROR;
+                snprintf(r->detail, sizeof(r->detail), "Emulation stopped (see log)");
+                return;
+        }
+        r->status = (w.reason == UMAC_WD_STALL) ? ST_HANG : ST_CRASH;
+        umac_watchdog_describe(&w, r->detail, sizeof(r->detail));
+}
+
+static void     machine_stop(void)
+{
+        if (disc_base)
+                munmap(disc_base, disc_size);
+        disc_base = NULL;
+}
+
+/* Run j's script on the current machine.  Script times and the time
+ * limit count from now.
+ */
+static void     job_script(job_t *j, result_t *r)
+{
+        FILE *script = NULL;
+        uint64_t start = umac_get_time_us();
+        uint64_t limit_us = start + (uint64_t)(j->limit_s * 1000000);
+
+        if (j->script) {
+                script = fopen(j->script, "r");
+                if (!script) {
+                        r->status = ST_ERROR;
+                        snprintf(r->detail, sizeof(r->detail), "Can't open script %s", j->script);
+                        return;
+                }
+        }
+
+        /* With no script, surviving to the time limit is a pass: */
+        r->status = script ? ST_TIMEOUT : ST_PASS;
+
+        char line[256];
+        int lineno = 0;
+        int have_cmd = 0;
+        int done = 0;
+        uint64_t cmd_us = 0;
+        char *cmd = NULL;
+
+        while (!done) {
+                if (script && !have_cmd) {
+                        if (!fgets(line, sizeof(line), script)) {
+                                /* Ran off the end: that's a pass */
+                                r->status = ST_PASS;
+                                break;
+                        }
+                        lineno++;
+                        char *t = strtok(line, " \t\r\n");
+                        if (!t || t[0] == '#')
+                                continue;
+                        cmd_us = start + strtoull(t, NULL, 0) * 1000;
+                        cmd = strtok(NULL, "");
+                        have_cmd = 1;
+                }
+
+                uint64_t now = umac_get_time_us();
+                uint64_t until = limit_us;
+                if (have_cmd && cmd_us < until)
+                        until = cmd_us;
+
+                if (until > now) {
+                        int run = umac_run_until(until - now, RUN_STOP_ON, NULL);
+
+                        if (run == UMAC_RUN_DONE || run == UMAC_RUN_WATCHDOG) {
+                                machine_died(r);
+                                break;
+                        }
+                }
+                now = umac_get_time_us();
+
+                if (have_cmd && now >= cmd_us) {
+                        have_cmd = 0;
+                        done = script_cmd(cmd, lineno, r);
+                } else if (now >= limit_us) {
+                        done = 1;
+                }
+        }
+
+        if (script)
+                fclose(script);
+        r->emu_us = umac_get_time_us() - start;
+        r->fb_hash = fb_hash();
+}
+
+static void     job_run(job_t *j, result_t *r)
+{
+        uint64_t start = get_usec();
+
+        r->status = ST_ERROR;
+        if (machine_start(j, r) == 0)
+                job_script(j, r);
+        machine_stop();
+        r->host_us = get_usec() - start;
+}
+
+static void     worker(void)
+{
+        ram_buf = malloc(RAM_SIZE);
+        if (!ram_buf)
+                exit(1);
+
+        while (1) {
+                int n = __atomic_fetch_add(next_job, 1, __ATOMIC_SEQ_CST);
+                if (n >= num_jobs)
+                        break;
+
+                result_t *r = &results[n];
+                r->worker = getpid();
+                __atomic_store_n(&r->state, RES_RUNNING, __ATOMIC_SEQ_CST);
+                fprintf(stderr, "[%d] %s\n", (int)getpid(), jobs[n].name);
+                job_run(&jobs[n], r);
+                __atomic_store_n(&r->state, RES_DONE, __ATOMIC_SEQ_CST);
+        }
+        exit(0);
+}
+
+/* A worker died: fail whichever of its jobs didn't finish */
+static void     worker_reap(pid_t pid, int wstatus)
+{
+        for (int i = 0; i < num_jobs; i++) {
+                result_t *r = &results[i];
+                if (r->state == RES_RUNNING && r->worker == pid) {
+                        r->state = RES_DONE;
+                        r->status = ST_CRASH;
+                        snprintf(r->detail, sizeof(r->detail), "Worker %s %d",
+                                 WIFSIGNALED(wstatus) ? "killed by signal" : "exited",
+                                 WIFSIGNALED(wstatus) ? WTERMSIG(wstatus) : WEXITSTATUS(wstatus));
+                }
+        }
+}
+
+/**********************************************************************/
+// Template mode
+//
+// Booting from a floppy takes many seconds of emulated time, which is
+// wasted if every job in a sweep boots the same ROM/disc to the same
+// desktop.  Instead, a template process boots that machine once, lets
+// it settle, then forks a child per job.  The children share the
+// template's RAM, disc mapping and CPU state copy-on-write (both RAM
+// and disc are private mappings), so each starts at the booted state
+// within a fork() and only pays for the pages it then writes.
+
+/* After booting, wait up to this long for the guest to go idle */
+#define TEMPLATE_SETTLE_US      (10 * 1000000)
+
+static int      same_machine(job_t *a, job_t *b)
+{
+        if (strcmp(a->rom, b->rom))
+                return 0;
+        if (!a->disc || !b->disc)
+                return a->disc == b->disc;
+        return !strcmp(a->disc, b->disc);
+}
+
+/* Boot the machine for jobs[first], then run every pending job that
+ * uses the same machine, each in a fork of it, up to max_live at once.
+ */
+static void     template(int first, uint64_t boot_us, int max_live)
+{
+        result_t boot = {0};
+        uint64_t start = get_usec();
+        int live = 0;
+
+        ram_buf = malloc(RAM_SIZE);
+        if (!ram_buf)
+                exit(1);
+
+        if (machine_start(&jobs[first], &boot) == 0) {
+                int run = umac_run_until(boot_us, RUN_STOP_ON, NULL);
+
+                /* UMAC_RUN_IDLE only reports going idle, so don't wait
+                 * for it if the guest already is:
+                 */
+                if (run != UMAC_RUN_DONE && run != UMAC_RUN_WATCHDOG && !umac_idle_until())
+                        run = umac_run_until(TEMPLATE_SETTLE_US,
+                                             RUN_STOP_ON | UMAC_STOP_ON(UMAC_RUN_IDLE), NULL);
+                if (run == UMAC_RUN_DONE || run == UMAC_RUN_WATCHDOG)
+                        machine_died(&boot);
+        }
+        if (boot.detail[0]) {
+                fprintf(stderr, "[%d] Template for %s: %s\n", (int)getpid(),
+                        jobs[first].name, boot.detail);
+        } else {
+                fprintf(stderr, "[%d] Template for %s booted to %llums in %.1fs\n",
+                        (int)getpid(), jobs[first].name,
+                        (unsigned long long)umac_get_time_us() / 1000,
+                        (get_usec() - start) / 1000000.0);
+        }
+
+        for (int i = first; i < num_jobs; i++) {
+                result_t *r = &results[i];
+
+                if (r->state != RES_PENDING || !same_machine(&jobs[first], &jobs[i]))
+                        continue;
+                if (boot.detail[0]) {
+                        r->status = ST_ERROR;
+                        memcpy(r->detail, boot.detail, sizeof(r->detail));
+                        r->state = RES_DONE;
+                        continue;
+                }
+
+                if (live >= max_live) {
+                        int wstatus;
+                        pid_t pid = wait(&wstatus);
+                        if (pid > 0) {
+                                live--;
+                                worker_reap(pid, wstatus);
+                        }
+                }
+
+                r->state = RES_RUNNING;
+                fflush(stdout);
+                fflush(stderr);
+                pid_t pid = fork();
+                if (pid == 0) {
+                        uint64_t job_start = get_usec();
+                        job_script(&jobs[i], r);
+                        r->host_us = get_usec() - job_start;
+                        __atomic_store_n(&r->state, RES_DONE, __ATOMIC_SEQ_CST);
+                        exit(0);
+                }
+                if (pid < 0) {
+                        perror("fork");
+                        r->status = ST_ERROR;
+                        snprintf(r->detail, sizeof(r->detail), "Can't fork template");
+                        r->state = RES_DONE;
+                        continue;
+                }
+                r->worker = pid;
+                live++;
+        }
+
+        while (live > 0) {
+                int wstatus;
+                pid_t pid = wait(&wstatus);
+                if (pid < 0)
+                        break;
+                live--;
+                worker_reap(pid, wstatus);
+        }
+        machine_stop();
+        exit(0);
+}
+
+/**********************************************************************/
+
+static pid_t    worker_spawn(void)
+{
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid == 0)
+                worker();
+        if (pid < 0)
+                perror("fork");
+        return pid;
+}
+
+int     main(int argc, char *argv[])
+{
+        int ch;
+        int opt_jobs = 0;
+        double opt_limit = JOB_DEFAULT_LIMIT_S;
+        double opt_boot = 0;
+        char *results_filename = NULL;
+
+        while ((ch = getopt(argc, argv, "b:g:j:l:o:h")) != -1) {
+                switch (ch) {
+                case 'b':
+                        opt_boot = atof(optarg);
+                        break;
+
+                case 'g':
+                        watchdog_s = atoi(optarg);
+                        break;
+
+                case 'j':
+                        opt_jobs = atoi(optarg);
+                        break;
+
+                case 'l':
+                        opt_limit = atof(optarg);
+                        break;
+
+                case 'o':
+                        results_filename = strdup(optarg);
+                        break;
+
+                case 'h':
+                default:
+                        print_help(argv[0]);
+                        return 1;
+                }
+        }
+        if (optind != argc - 1) {
+                print_help(argv[0]);
+                return 1;
+        }
+
+        if (manifest_load(argv[optind], opt_limit))
+                return 1;
+        if (num_jobs == 0)
+                return 0;
+
+        if (opt_jobs <= 0)
+                opt_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (opt_jobs <= 0)
+                opt_jobs = 1;
+        if (opt_jobs > num_jobs)
+                opt_jobs = num_jobs;
+
+        /* Results and the job counter are shared with the workers: */
+        size_t shm_size = sizeof(int) + num_jobs * sizeof(result_t);
+        void *shm = mmap(0, shm_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shm == MAP_FAILED) {
+                perror("mmap");
+                return 1;
+        }
+        memset(shm, 0, shm_size);
+        results = (result_t *)shm;
+        next_job = (int *)(results + num_jobs);
+
+        uint64_t start = get_usec();
+        int live = 0;
+
+        if (opt_boot > 0) {
+                /* One template at a time, each running all of the jobs
+                 * using its machine:
+                 */
+                for (int i = 0; i < num_jobs; i++) {
+                        if (results[i].state != RES_PENDING)
+                                continue;
+                        fflush(stdout);
+                        fflush(stderr);
+                        pid_t pid = fork();
+                        if (pid == 0)
+                                template(i, (uint64_t)(opt_boot * 1000000), opt_jobs);
+                        if (pid < 0) {
+                                perror("fork");
+                                break;
+                        }
+                        waitpid(pid, NULL, 0);
+                        /* Anything left over was lost with the template: */
+                        for (int j = i; j < num_jobs; j++) {
+                                if (same_machine(&jobs[i], &jobs[j]) &&
+                                    results[j].state != RES_DONE) {
+                                        results[j].state = RES_DONE;
+                                        results[j].status = ST_CRASH;
+                                        snprintf(results[j].detail, sizeof(results[j].detail),
+                                                 "Template died");
+                                }
+                        }
+                }
+        }
+
+        for (int i = 0; i < opt_jobs && opt_boot <= 0; i++) {
+                if (worker_spawn() > 0)
+                        live++;
+        }
+
+        /* If a worker dies (host crash in the core), fail its job and
+         * replace it, so the rest of the batch still gets run:
+         */
+        while (live > 0) {
+                int wstatus;
+                pid_t pid = wait(&wstatus);
+
+                if (pid < 0)
+                        break;
+                live--;
+                if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0)
+                        continue;
+
+                worker_reap(pid, wstatus);
+                if (__atomic_load_n(next_job, __ATOMIC_SEQ_CST) < num_jobs &&
+                    worker_spawn() > 0)
+                        live++;
+        }
+
+        ////////////////////////////////////////////////////////////////////////
+        // Results, tab-separated, in manifest order
+
+        FILE *out = stdout;
+        if (results_filename) {
+                out = fopen(results_filename, "w");
+                if (!out) {
+                        perror("Results");
+                        return 1;
+                }
+        }
+
+        int passed = 0;
+        fprintf(out, "# name\tstatus\temu_ms\thost_ms\tfb_hash\tdetail\n");
+        for (int i = 0; i < num_jobs; i++) {
+                result_t *r = &results[i];
+                int status = (r->state == RES_DONE) ? r->status : ST_CRASH;
+
+                if (status == ST_PASS)
+                        passed++;
+                fprintf(out, "%s\t%s\t%llu\t%llu\t%08x\t%s\n", jobs[i].name,
+                        status_names[status],
+                        (unsigned long long)r->emu_us / 1000,
+                        (unsigned long long)r->host_us / 1000,
+                        r->fb_hash, r->detail);
+        }
+        if (out != stdout)
+                fclose(out);
+
+        fprintf(stderr, "%d/%d jobs passed, %d workers, %.1fs\n", passed, num_jobs,
+                opt_jobs, (get_usec() - start) / 1000000.0);
+        return (passed == num_jobs) ? 0 : 2;
+}
@@ -156,12 +156,55 @@ static sony_drinfo_t *get_drive_info(int num)
         return 0;
 }
 
+/*
+ *  Transfers between RAM and op_read/op_write callbacks.  These go
+ *  direct to RAM, except when RAM is swizzled (see machw.h), where
+ *  they bounce via a sector buffer.
+ */
+
+#define DISC_BOUNCE_SIZE        512
+
+static int disc_op_read_ram(sony_drinfo_t *info, uint32_t addr, uint32_t pos, size_t len)
+{
+#if UMAC_RAM_SWIZZLE
+        uint8_t buf[DISC_BOUNCE_SIZE];
+
+        for (size_t done = 0; done < len; done += DISC_BOUNCE_SIZE) {
+                int r = info->op_read(info->op_ctx, buf, pos + done, DISC_BOUNCE_SIZE);
+                if (r < 0)
+                        return r;
+                ram_copy_in(addr + done, buf, DISC_BOUNCE_SIZE);
+        }
+        return 0;
+#else
+        return info->op_read(info->op_ctx, Mac2HostAddr(addr), pos, len);
+#endif
+}
+
+static int disc_op_write_ram(sony_drinfo_t *info, uint32_t addr, uint32_t pos, size_t len)
+{
+#if UMAC_RAM_SWIZZLE
+        uint8_t buf[DISC_BOUNCE_SIZE];
+
+        for (size_t done = 0; done < len; done += DISC_BOUNCE_SIZE) {
+                ram_copy_out(buf, addr + done, DISC_BOUNCE_SIZE);
+                int r = info->op_write(info->op_ctx, buf, pos + done, DISC_BOUNCE_SIZE);
+                if (r < 0)
+                        return r;
+        }
+        return 0;
+#else
+        return info->op_write(info->op_ctx, Mac2HostAddr(addr), pos, len);
+#endif
+}
+
 /*
  *  Initialization
  */
 
 void SonyInit(disc_descr_t discs[DISC_NUM_DRIVES])
 {
+        memset(drives, 0, sizeof(drives));
         drives[0].num = 0;
         drives[0].to_be_mounted = 1;
         drives[0].read_only = discs[0].read_only;
@@ -286,7 +329,7 @@ int16_t SonyPrime(uint32_t pb, uint32_t dce)
 	WriteMacInt8(info->status + dsDiskInPlace, 2);	// Disk accessed
 
 	// Get parameters
-	void *buffer = Mac2HostAddr(ReadMacInt32(pb + ioBuffer)); // FIXME
+	uint32_t buffer = ADR24(ReadMacInt32(pb + ioBuffer)); // FIXME
 	size_t length = ReadMacInt32(pb + ioReqCount);
 	uint32_t position = ReadMacInt32(dce + dCtlPosition);
 	if ((length & 0x1ff) || (position & 0x1ff)) {
@@ -303,11 +346,11 @@ int16_t SonyPrime(uint32_t pb, uint32_t dce)
                 DDBG("DISC: READ %ld from +0x%x\n", length, position);
                 if (info->data) {
                         DDBG(" (Read buffer: %p)\n", (void *)&info->data[position]);
-                        memcpy(buffer, &info->data[position], length);
+                        ram_copy_in(buffer, &info->data[position], length);
                 } else {
                         if (info->op_read) {
                                 DDBG(" (read op into buffer)\n");
-                                int r = info->op_read(info->op_ctx, buffer, position, length);
+                                int r = disc_op_read_ram(info, buffer, position, length);
                                 if (r < 0)
                                         return set_dsk_err(paramErr);
                         } else {
@@ -330,11 +373,11 @@ int16_t SonyPrime(uint32_t pb, uint32_t dce)
                 DDBG("DISC: WRITE %ld to +0x%x\n", length, position);
                 if (info->data) {
                         DDBG(" (Write buffer: %p)\n", (void *)&info->data[position]);
-                        memcpy(&info->data[position], buffer, length);
+                        ram_copy_out(&info->data[position], buffer, length);
                 } else {
                         if (info->op_write) {
                                 DDBG(" (write op into buffer)\n");
-                                int r = info->op_write(info->op_ctx, buffer, position, length);
+                                int r = disc_op_write_ram(info, buffer, position, length);
                                 if (r < 0)
                                         return set_dsk_err(paramErr);
                         } else {
@@ -501,7 +544,8 @@ int16_t SonyStatus(uint32_t pb, uint32_t dce)
 			break;
 
 		case 8:			// Get drive status
-                        memcpy(pb + csParam + ram_get_base(), ram_get_base() + info->status, 22);
+                        for (int i = 0; i < 22; i++)
+                                WriteMacInt8(pb + csParam + i, ReadMacInt8(info->status + i));
 			break;
 
 		case 10:		// Get disk type and MFM info
@@ -534,3 +578,59 @@ int16_t SonyStatus(uint32_t pb, uint32_t dce)
 
 	return set_dsk_err(err);
 }
+
+/*
+ *  Per-instance state, see umac_select().  Only the driver's own state
+ *  is saved; the host's pointers/callbacks come from disc_reattach(),
+ *  so the state can be loaded into another process (and hashes the
+ *  same in every run).
+ */
+
+struct disc_drive_state {
+        int32_t num;
+        int32_t to_be_mounted;
+        uint32_t status;
+};
+
+size_t disc_state_size(void)
+{
+        return sizeof(struct disc_drive_state) * DISC_NUM_DRIVES;
+}
+
+void disc_state_save(void *state)
+{
+        struct disc_drive_state *s = state;
+
+        for (int i = 0; i < DISC_NUM_DRIVES; i++) {
+                s[i].num = drives[i].num;
+                s[i].to_be_mounted = drives[i].to_be_mounted;
+                s[i].status = drives[i].status;
+        }
+}
+
+void disc_state_load(const void *state)
+{
+        const struct disc_drive_state *s = state;
+
+        for (int i = 0; i < DISC_NUM_DRIVES; i++) {
+                drives[i].num = s[i].num;
+                drives[i].to_be_mounted = s[i].to_be_mounted;
+                drives[i].status = s[i].status;
+        }
+}
+
+/*
+ *  After disc_state_load(), point the drives at this machine's disc data
+ */
+
+void disc_reattach(disc_descr_t discs[DISC_NUM_DRIVES])
+{
+        for (int i = 0; i < DISC_NUM_DRIVES; i++) {
+                drives[i].read_only = discs[i].read_only;
+                drives[i].data = discs[i].base;
+                drives[i].size = discs[i].size;
+                drives[i].op_ctx = discs[i].op_ctx;
+                drives[i].op_read = discs[i].op_read;
+                drives[i].op_write = discs[i].op_write;
+        }
+}
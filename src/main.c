@@ -39,6 +39,7 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <setjmp.h>
+#include <string.h>
 
 #include "machw.h"
 #include "m68k.h"
@@ -46,10 +47,16 @@
 #include "scc.h"
 #include "rom.h"
 #include "disc.h"
+#include "prof.h"
+#include "sched.h"
+#include "umac.h"
 
 #ifdef PICO
 #include "pico.h"
 #define FAST_FUNC(x)    __not_in_flash_func(x)
+#elif defined(__linux__) && defined(__GNUC__)
+/* Alongside the hot opcode handlers, see m68kconf.h */
+#define FAST_FUNC(x)    __attribute__((section(".text.hot." #x))) x
 #else
 #define FAST_FUNC(x)    x
 #endif
@@ -71,15 +78,56 @@ uint8_t *_ram_base;
 uint8_t *_rom_base;
 
 int overlay = 1;
+static disc_descr_t umac_discs[DISC_NUM_DRIVES];
 static uint64_t global_time_us = 0;
 static int sim_done = 0;
 static jmp_buf main_loop_jb;
 
 static int disassemble = 0;
+static int profile = 0;
+int cpu_instr_hook = 0;
+
+/* umac_run_until() stop conditions, see run_event() */
+static unsigned int run_stop_on = 0;
+static int run_reason = -1;
+static int vbl_latched = 0;     /* VBL since the last run started */
+static int mem_watch_fb = 0;
+static int mem_track_dirty = 0;
+
+#if UMAC_CYCLE_COUNTING
+/* Emulated time is derived from 68000 cycles executed.  The CPU clock
+ * is 7.8336MHz, but video/sound DMA steals RAM bus slots so the CPU
+ * is stalled for some of those clocks.  The contention is modelled
+ * as an average: the CPU gets CPU_BUS_SHARE_NUM/DEN of the clocks,
+ * i.e. ~6.1MHz effective, which is the usual figure for a Plus.
+ */
+#define CPU_CLOCK_HZ            7833600
+#define CPU_BUS_SHARE_NUM       25
+#define CPU_BUS_SHARE_DEN       32
+/* Multiply first, so short spans don't lose cycles to truncation: */
+#define CPU_US_TO_CYCLES(us)    ((uint64_t)(us) * CPU_CLOCK_HZ * CPU_BUS_SHARE_NUM / \
+                                 (1000000ULL * CPU_BUS_SHARE_DEN))
+#define CPU_CYCLES_TO_US(c)     ((uint64_t)(c) * CPU_BUS_SHARE_DEN * 1000000 / \
+                                 ((uint64_t)CPU_CLOCK_HZ * CPU_BUS_SHARE_NUM))
+
+static uint64_t global_clocks = 0;
+#else
+/* Otherwise, call it 8 cycles per us */
+#define CPU_US_TO_CYCLES(us)    ((uint64_t)(us) * 8)
+#define CPU_CYCLES_TO_US(c)     ((uint64_t)(c) / 8)
 
-#define UMAC_EXECLOOP_QUANTUM   5000
+static unsigned int global_cycles_frac = 0;
+#endif
 
 static void    update_overlay_layout(void);
+static void    idle_wake(void);
+static void    mouse_tick(void);
+static void    vbl_event(void);
+static void    onehz_event(void);
+static void    run_event(int reason);
+static uint64_t sched_now(void);
+static void    sched_deadline(uint64_t time);
+static void    core_state_reset(void);
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -110,22 +158,161 @@ static int      m68k_dump_regs(char *buf, int len)
         return orig_len - len;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Watchdog
+//
+// Notices a guest that's crashed or hung, so whoever's running it can
+// stop spending a core on it (or go back to a good state).  Checked
+// at each VBL, before it's delivered, using low-memory globals:
+//
+// - The OS's VBL interrupt handler increments Ticks.  If VBLs keep
+//   arriving but Ticks doesn't move, interrupts are off for good: a
+//   Sad Mac (critErr masks them), or a crash in an interrupt handler.
+// - SysError() stores its code in DSErrCode before drawing the bomb
+//   box.  DSErrCode is only watched once Ticks is seen counting VBLs,
+//   i.e. the OS is up; before that, RAM holds boot-time junk.  A
+//   repeat of the same code isn't noticed.  Only the range of actual
+//   errors counts: DSErrCode also holds alerts that aren't crashes
+//   (the greeting, "please insert", shutdown), negative boot codes,
+//   and 20000+ shutdown/restart codes.
+//
+// exit_error() is reported here too.  The stall check needs a timeout
+// (umac_opt_watchdog()), but errors are always reported.
+
+#define LM_TICKS                0x16a
+#define LM_DSERRCODE            0xaf0
+#define DS_ERR_MIN              1       /* dsBusErr */
+#define DS_ERR_MAX              127
+#define DS_REINSERT             30      /* "Please insert the disk" */
+#define DS_GREETING             40      /* "Welcome to Macintosh" */
+#define DS_SHUTDOWN             42      /* "You may now switch off" */
+
+static unsigned int wd_stall_vbls = 0;  /* 0 = off */
+static unsigned int wd_vbls = 0;        /* VBLs since Ticks changed */
+static uint32_t wd_ticks = 0;
+static uint64_t wd_ticks_time = 0;
+static uint64_t wd_check_time = 0;
+static int wd_os_up = 0;
+static uint16_t wd_errcode = 0;
+static umac_watchdog_t wd_event;
+
+static void     watchdog_fire(int reason, int code, uint32_t pc, uint64_t since_us)
+{
+        memset(&wd_event, 0, sizeof(wd_event));
+        wd_event.reason = reason;
+        wd_event.code = code;
+        wd_event.time_us = global_time_us;
+        wd_event.since_us = since_us;
+        wd_event.pc = pc;
+        wd_event.sr = m68k_get_reg(NULL, M68K_REG_SR);
+        for (int i = 0; i < 8; i++) {
+                wd_event.d[i] = m68k_get_reg(NULL, M68K_REG_D0 + i);
+                wd_event.a[i] = m68k_get_reg(NULL, M68K_REG_A0 + i);
+        }
+        run_event(UMAC_RUN_WATCHDOG);
+}
+
+static void     watchdog_vbl(void)
+{
+        uint64_t last_check = wd_check_time;
+
+        wd_check_time = global_time_us;
+
+        uint32_t ticks = RAM_RD32(LM_TICKS);
+        if (ticks != wd_ticks) {
+                if (!wd_os_up && ticks - wd_ticks <= wd_vbls + 1) {
+                        wd_os_up = 1;
+                        wd_errcode = RAM_RD16(LM_DSERRCODE);
+                }
+                wd_ticks = ticks;
+                wd_ticks_time = global_time_us;
+                wd_vbls = 0;
+        } else if (++wd_vbls >= wd_stall_vbls && wd_stall_vbls) {
+                watchdog_fire(UMAC_WD_STALL, 0, m68k_get_reg(NULL, M68K_REG_PC),
+                              wd_ticks_time);
+                /* Report again if it's still stuck after as long again: */
+                wd_vbls = 0;
+        }
+
+        if (wd_os_up) {
+                uint16_t code = RAM_RD16(LM_DSERRCODE);
+                int16_t err = (int16_t)code;
+
+                if (code != wd_errcode) {
+                        wd_errcode = code;
+                        if (err >= DS_ERR_MIN && err <= DS_ERR_MAX &&
+                            err != DS_REINSERT && err != DS_GREETING && err != DS_SHUTDOWN)
+                                watchdog_fire(UMAC_WD_SYSERROR, err,
+                                              m68k_get_reg(NULL, M68K_REG_PC), last_check);
+                }
+        }
+}
+
+/* Call after umac_init().  Reports a guest stalled for stall_s seconds
+ * (of VBLs); 0 disables that.  System Errors are reported regardless.
+ */
+void    umac_opt_watchdog(unsigned int stall_s)
+{
+        wd_stall_vbls = stall_s * 60;
+        wd_vbls = 0;
+        wd_ticks = RAM_RD32(LM_TICKS);
+        wd_ticks_time = global_time_us;
+}
+
+/* Returns the UMAC_WD_x reason for the last watchdog event (or
+ * UMAC_WD_NONE), filling in *w, and clears it.
+ */
+int     umac_watchdog_get(umac_watchdog_t *w)
+{
+        int r = wd_event.reason;
+
+        if (w)
+                *w = wd_event;
+        memset(&wd_event, 0, sizeof(wd_event));
+        return r;
+}
+
+/* One line summing up w, into buf */
+void    umac_watchdog_describe(const umac_watchdog_t *w, char *buf, size_t len)
+{
+        switch (w->reason) {
+        case UMAC_WD_EXIT_ERROR:
+                snprintf(buf, len, "Emulation error at PC %06x: %s", w->pc, w->msg);
+                break;
+        case UMAC_WD_SYSERROR:
+                snprintf(buf, len, "System Error %d at PC %06x", w->code, w->pc);
+                break;
+        case UMAC_WD_STALL:
+                snprintf(buf, len, "No VBL progress since %.2fs, PC %06x%s",
+                         w->since_us / 1000000.0, w->pc,
+                         ((w->sr & 0x700) == 0x700) ? " with interrupts masked" : "");
+                break;
+        default:
+                snprintf(buf, len, "No watchdog event");
+        }
+}
+
+static int exit_error_guard = 0;
+
 /* Exit with an error message.  Use printf syntax. */
 void exit_error(char* fmt, ...)
 {
-	static int guard_val = 0;
 	char buff[500];
 	unsigned int pc;
 	va_list args;
 
-	if(guard_val)
+	if(exit_error_guard)
 		return;
 	else
-		guard_val = 1;
+		exit_error_guard = 1;
 
 	va_start(args, fmt);
 	vfprintf(stderr, fmt, args);
 	va_end(args);
+	va_start(args, fmt);
+	watchdog_fire(UMAC_WD_EXIT_ERROR, 0, m68k_get_reg(NULL, M68K_REG_PPC), global_time_us);
+	vsnprintf(wd_event.msg, sizeof(wd_event.msg), fmt, args);
+	va_end(args);
 	fprintf(stderr, "\n");
 	pc = m68k_get_reg(NULL, M68K_REG_PPC);
 	m68k_disassemble(buff, pc, M68K_CPU_TYPE_68000);
@@ -140,9 +327,10 @@ void exit_error(char* fmt, ...)
 
 ////////////////////////////////////////////////////////////////////////////////
 // VIA-related controls
+static uint8_t via_ra_oldval = 0x10;
+
 static void     via_ra_changed(uint8_t val)
 {
-        static uint8_t oldval = 0x10;
         // 7 = scc w/req,a,b (in, indicates RX pending, w/o IRQ)
         // 6 = vid.pg2 (screen buffer select)
         // 5 = hd.sel (SEL line, select head)
@@ -150,12 +338,15 @@ static void     via_ra_changed(uint8_t val)
         // 3 = snd.pg2 (sound buffer select)
         // [2:0] = sound volume
         overlay = !!(val & 0x10);
-        if ((oldval ^ val) & 0x10) {
+        if ((via_ra_oldval ^ val) & 0x10) {
                 MDBG("OVERLAY CHANGING\n");
                 update_overlay_layout();
+                /* Rebooting, so low memory's junk for a while: */
+                if (overlay)
+                        wd_os_up = 0;
         }
 
-        oldval = val;
+        via_ra_oldval = val;
 }
 
 static void     via_rb_changed(uint8_t val)
@@ -212,8 +403,13 @@ static uint8_t  via_rb_in(void)
 #define KBD_MODEL               5
 #define KBD_RSP_NULL            0x7b
 
+/* Respond to a keyboard command this long after it's transmitted
+ * (i.e. not immediately, which makes the mac feel rushed and causes it
+ * to ignore the response to punish our hastiness).
+ */
+#define KBD_RSP_DELAY_US        5000
+
 static int kbd_last_cmd = 0;
-static uint64_t kbd_last_cmd_time = 0;
 
 static void     via_sr_tx(uint8_t data)
 {
@@ -222,7 +418,7 @@ static void     via_sr_tx(uint8_t data)
                      data, kbd_last_cmd);
         }
         kbd_last_cmd = data;
-        kbd_last_cmd_time = global_time_us;
+        sched_post(SCHED_EVT_KBD, KBD_RSP_DELAY_US);
 }
 
 static int kbd_pending_evt = -1;
@@ -250,19 +446,12 @@ static void     kbd_rx(uint8_t data)
         }
 }
 
-static void     kbd_check_work(void)
+/* Scheduled KBD_RSP_DELAY_US after a command was transmitted */
+static void     kbd_cmd_event(void)
 {
-        /* Process a keyboard command a little later than the transmit
-         * time (i.e. not immediately, which makes the mac feel rushed
-         * and causes it to ignore the response to punish our
-         * hastiness).
-         */
-        if (kbd_last_cmd &&
-            ((global_time_us - kbd_last_cmd_time) > UMAC_EXECLOOP_QUANTUM)) {
-                MDBG("KBD: got cmd 0x%x\n", kbd_last_cmd);
-                kbd_rx(kbd_last_cmd);
-                kbd_last_cmd = 0;
-        }
+        MDBG("KBD: got cmd 0x%x\n", kbd_last_cmd);
+        kbd_rx(kbd_last_cmd);
+        kbd_last_cmd = 0;
 }
 
 void    umac_kbd_event(uint8_t scancode, int down)
@@ -273,6 +462,7 @@ void    umac_kbd_event(uint8_t scancode, int down)
                 /* FIXME: Add a queue */
         }
         kbd_pending_evt = scancode | (down ? 0 : 0x80);
+        idle_wake();
 }
 
 // VIA IRQ output hook:
@@ -281,6 +471,7 @@ static void     via_irq_set(int status)
         MDBG("[IRQ: VIA IRQ %d]\n", status);
         if (status) {
                 // IRQ is asserted
+                idle_wake();
                 m68k_set_virq(1, 1);
         } else {
                 // IRQ de-asserted
@@ -288,12 +479,21 @@ static void     via_irq_set(int status)
         }
 }
 
+// A masked event doesn't raise an IRQ, but an idle guest could be
+// polling for it:
+static void     via_ifr_flagged(uint8_t flags)
+{
+        (void)flags;
+        idle_wake();
+}
+
 // Ditto, for SCC
 static int scc_irq_state = 0;
 static void     scc_irq_set(int status)
 {
         MDBG("[IRQ: SCC IRQ %d]\n", status);
         if (status) {
+                idle_wake();
                 m68k_set_virq(2, 1);
         } else {
                 m68k_set_virq(2, 0);
@@ -301,6 +501,11 @@ static void     scc_irq_set(int status)
         scc_irq_state = status;
 }
 
+static void     scc_status_changed(void)
+{
+        idle_wake();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // IWM
 
@@ -337,31 +542,119 @@ uint8_t iwm_read(unsigned int address)
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static unsigned int  FAST_FUNC(cpu_read_instr_normal)(unsigned int address)
+/* Memory map: see the comment in machw.h.  This is rebuilt by
+ * update_overlay_layout() when the overlay bit changes; the fast
+ * paths in cpu_cb.h look it up directly.
+ */
+struct mem_page mem_map[MEM_NUM_PAGES];
+
+static uint8_t *mem_ram_page(unsigned int page)
 {
-        /* Can check for 0x400000 (ROM) and otherwise RAM */
-        if ((address & 0xf00000) != ROM_ADDR)
-                return RAM_RD_ALIGNED_BE16(CLAMP_RAM_ADDR(address));
-        else
-                return ROM_RD_ALIGNED_BE16(address & (ROM_SIZE - 1));
+        unsigned int offset = CLAMP_RAM_ADDR(page << MEM_PAGE_SHIFT);
+
+        if (offset + MEM_PAGE_SIZE > RAM_SIZE)
+                return NULL;
+        return _ram_base + offset;
 }
 
-static unsigned int  FAST_FUNC(cpu_read_instr_overlay)(unsigned int address)
+static uint8_t *mem_rom_page(unsigned int page)
 {
-        /* Need to check for both 0=ROM, 0x400000=ROM, and RAM at 0x600000...
-         */
+        return _rom_base + ((page << MEM_PAGE_SHIFT) & (ROM_SIZE - 1));
+}
+
+static int      mem_page_has_fb(unsigned int page)
+{
+        unsigned int offset = CLAMP_RAM_ADDR(page << MEM_PAGE_SHIFT);
+        unsigned int fb = umac_get_fb_offset();
+
+        return offset < (fb + DISP_WIDTH * DISP_HEIGHT / 8) &&
+                (offset + MEM_PAGE_SIZE) > fb;
+}
+
+/* RAM pages written since the last umac_ram_dirty_collect().  While
+ * tracking, clean pages' writes go via the slow path, which marks them
+ * dirty then maps them back in for fast writes.
+ */
+static uint8_t ram_dirty[UMAC_RAM_NUM_PAGES];
+
+static void     mem_map_build(void);
+
+static void     ram_mark_dirty(unsigned int offset)
+{
+        unsigned int p = offset >> MEM_PAGE_SHIFT;
+
+        if (!ram_dirty[p]) {
+                ram_dirty[p] = 1;
+                mem_map_build();
+        }
+}
+
+/* RAM write of len bytes via the slow path: */
+static inline void ram_write_watch(unsigned int offset, unsigned int len)
+{
+        unsigned int fb = umac_get_fb_offset();
+
+        if (mem_watch_fb && offset >= fb && offset < (fb + DISP_WIDTH * DISP_HEIGHT / 8))
+                run_event(UMAC_RUN_FB);
+        if (mem_track_dirty) {
+                ram_mark_dirty(offset);
+                ram_mark_dirty(CLAMP_RAM_ADDR(offset + len - 1));
+        }
+}
+
+static void     mem_map_build(void)
+{
+        for (unsigned int p = 0; p < MEM_NUM_PAGES; p++) {
+                unsigned int a = p << MEM_PAGE_SHIFT;
+
+                if (IS_RAM(a)) {
+                        mem_map[p].rd = mem_map[p].wr = mem_ram_page(p);
+                        /* Send framebuffer writes to the slow path if
+                         * they're being watched for:
+                         */
+                        if (mem_watch_fb && mem_page_has_fb(p))
+                                mem_map[p].wr = NULL;
+                        /* Likewise the first write to a clean page: */
+                        if (mem_track_dirty && !ram_dirty[CLAMP_RAM_ADDR(a) >> MEM_PAGE_SHIFT])
+                                mem_map[p].wr = NULL;
+                } else if (IS_ROM(a)) {
+                        mem_map[p].rd = mem_rom_page(p);
+                        mem_map[p].wr = NULL;
+                } else {
+                        mem_map[p].rd = mem_map[p].wr = NULL;
+                }
+        }
+}
+
+/* Instruction fetch window (see cpu_cb.h) */
+unsigned int cpu_fetch_page = CPU_FETCH_PAGE_NONE;
+uint8_t *cpu_fetch_host;
+
+/* Instruction fetch that missed the fetch window: move the window to
+ * this page if it's directly mapped.  Otherwise, instructions never
+ * come from MMIO, so this is either ROM or (wrapping) RAM.
+ */
+unsigned int    FAST_FUNC(cpu_read_instr_refill)(unsigned int address)
+{
+        unsigned int page = MEM_PAGE(address);
+        uint8_t *p = mem_map[page].rd;
+
+        if (p) {
+                cpu_fetch_page = page;
+                cpu_fetch_host = p;
+                return MEM_RD16_AL(p, address & MEM_PAGE_MASK);
+        }
         if (IS_ROM(address))
                 return ROM_RD_ALIGNED_BE16(address & (ROM_SIZE - 1));
-        else /* RAM */
-                return RAM_RD_ALIGNED_BE16(CLAMP_RAM_ADDR(address));
+        return RAM_RD_ALIGNED_BE16(CLAMP_RAM_ADDR(address));
 }
 
-unsigned int (*cpu_read_instr)(unsigned int address) = cpu_read_instr_overlay;
-
-/* Read data from RAM, ROM, or a device */
-unsigned int    FAST_FUNC(cpu_read_byte)(unsigned int address)
+/* Slow paths: anything not handled by the inline fast paths in
+ * cpu_cb.h (I/O, unaligned or page-crossing accesses, plus RAM pages
+ * that wrap for non-Po2 sizes) comes here.
+ */
+unsigned int    FAST_FUNC(cpu_read_byte_slow)(unsigned int address)
 {
-        /* Most likely a RAM access, followed by a ROM access, then I/O */
         if (IS_RAM(address))
                 return RAM_RD8(CLAMP_RAM_ADDR(address));
         if (IS_ROM(address))
@@ -381,7 +674,7 @@ unsigned int    FAST_FUNC(cpu_read_byte)(unsigned int address)
         return 0;
 }
 
-unsigned int    FAST_FUNC(cpu_read_word)(unsigned int address)
+unsigned int    FAST_FUNC(cpu_read_word_slow)(unsigned int address)
 {
         if (IS_RAM(address))
                 return RAM_RD16(CLAMP_RAM_ADDR(address));
@@ -395,7 +688,7 @@ unsigned int    FAST_FUNC(cpu_read_word)(unsigned int address)
         return 0;
 }
 
-unsigned int    FAST_FUNC(cpu_read_long)(unsigned int address)
+unsigned int    FAST_FUNC(cpu_read_long_slow)(unsigned int address)
 {
         if (IS_RAM(address))
                 return RAM_RD32(CLAMP_RAM_ADDR(address));
@@ -409,9 +702,12 @@ unsigned int    FAST_FUNC(cpu_read_long)(unsigned int address)
         return 0;
 }
 
-
 unsigned int    cpu_read_word_dasm(unsigned int address)
 {
+        uint8_t *p = mem_map[MEM_PAGE(address)].rd;
+
+        if (p && (address & MEM_PAGE_MASK) <= (MEM_PAGE_SIZE - 2))
+                return MEM_RD16(p, address & MEM_PAGE_MASK);
         if (IS_RAM(address))
                 return RAM_RD16(CLAMP_RAM_ADDR(address));
         if (IS_ROM(address))
@@ -423,6 +719,10 @@ unsigned int    cpu_read_word_dasm(unsigned int address)
 
 unsigned int    cpu_read_long_dasm(unsigned int address)
 {
+        uint8_t *p = mem_map[MEM_PAGE(address)].rd;
+
+        if (p && (address & MEM_PAGE_MASK) <= (MEM_PAGE_SIZE - 4))
+                return MEM_RD32(p, address & MEM_PAGE_MASK);
         if (IS_RAM(address))
                 return RAM_RD32(CLAMP_RAM_ADDR(address));
         if (IS_ROM(address))
@@ -433,11 +733,11 @@ unsigned int    cpu_read_long_dasm(unsigned int address)
 }
 
 
-/* Write data to RAM or a device */
-void    FAST_FUNC(cpu_write_byte)(unsigned int address, unsigned int value)
+void    FAST_FUNC(cpu_write_byte_slow)(unsigned int address, unsigned int value)
 {
         if (IS_RAM(address)) {
                 RAM_WR8(CLAMP_RAM_ADDR(address), value);
+                ram_write_watch(CLAMP_RAM_ADDR(address), 1);
                 return;
         }
 
@@ -460,37 +760,42 @@ void    FAST_FUNC(cpu_write_byte)(unsigned int address, unsigned int value)
                 int r = disc_pv_hook(value);
                 if (r)
                         exit_error("Disc PV hook failed (%02x)", value);
+                /* The disc driver writes RAM directly: */
+                if (mem_track_dirty) {
+                        memset(ram_dirty, 1, sizeof(ram_dirty));
+                        mem_map_build();
+                }
+                run_event(UMAC_RUN_DISC);
                 return;
         }
         printf("Ignoring write %02x to address %08x\n", value&0xff, address);
 }
 
-void    FAST_FUNC(cpu_write_word)(unsigned int address, unsigned int value)
+void    FAST_FUNC(cpu_write_word_slow)(unsigned int address, unsigned int value)
 {
         if (IS_RAM(address)) {
                 RAM_WR16(CLAMP_RAM_ADDR(address), value);
+                ram_write_watch(CLAMP_RAM_ADDR(address), 2);
                 return;
         }
         printf("Ignoring write %04x to address %08x\n", value&0xffff, address);
 }
 
-void    FAST_FUNC(cpu_write_long)(unsigned int address, unsigned int value)
+void    FAST_FUNC(cpu_write_long_slow)(unsigned int address, unsigned int value)
 {
         if (IS_RAM(address)) {
                 RAM_WR32(CLAMP_RAM_ADDR(address), value);
+                ram_write_watch(CLAMP_RAM_ADDR(address), 4);
                 return;
         }
         printf("Ignoring write %08x to address %08x\n", value, address);
 }
 
-/* Update function pointers for memory accessors based on overlay state/memory map layout */
+/* Rebuild the memory map based on overlay state/memory map layout */
 static void     update_overlay_layout(void)
 {
-        if (overlay) {
-                cpu_read_instr = cpu_read_instr_overlay;
-        } else {
-                cpu_read_instr = cpu_read_instr_normal;
-        }
+        mem_map_build();
+        cpu_fetch_page = CPU_FETCH_PAGE_NONE;
 }
 
 /* Called when the CPU pulses the RESET line */
@@ -547,12 +852,32 @@ static void     make_hex(char* buff, unsigned int pc, unsigned int length)
 	}
 }
 
+/* Breakpoints, checked from the instruction hook */
+#define UMAC_MAX_BREAKPOINTS    8
+
+static uint32_t breakpoints[UMAC_MAX_BREAKPOINTS];
+static int num_breakpoints = 0;
+
+static void     instr_hook_update(void)
+{
+        cpu_instr_hook = disassemble || profile || num_breakpoints;
+}
+
 void    cpu_instr_callback(int pc)
 {
 	static char buff[100];
 	static char buff2[100];
 	static unsigned int instr_size;
 
+#ifdef ENABLE_DASM
+        if (profile)
+                prof_instr(pc);
+#endif
+        for (int i = 0; i < num_breakpoints; i++) {
+                if (breakpoints[i] == ADR24(pc))
+                        run_event(UMAC_RUN_BREAKPOINT);
+        }
+
         if (!disassemble)
                 return;
 
@@ -564,8 +889,20 @@ void    cpu_instr_callback(int pc)
 
 int     umac_init(void *ram_base, void *rom_base, disc_descr_t discs[DISC_NUM_DRIVES])
 {
+        core_state_reset();
         _ram_base = ram_base;
         _rom_base = rom_base;
+        memcpy(umac_discs, discs, sizeof(umac_discs));
+#if UMAC_RAM_SWIZZLE
+        /* ROM is accessed through the same paths as RAM, so convert
+         * it to the swizzled layout (see machw.h):
+         */
+        for (unsigned int i = 0; i < ROM_SIZE; i += 2) {
+                uint16_t v = READ_WORD(_rom_base, i);
+                MEM_WR16_AL(_rom_base, i, v);
+        }
+#endif
+        update_overlay_layout();
 
 	m68k_init();
 	m68k_set_cpu_type(M68K_CPU_TYPE_68000);
@@ -577,9 +914,19 @@ int     umac_init(void *ram_base, void *rom_base, disc_descr_t discs[DISC_NUM_DR
                               .rb_in = via_rb_in,
                               .sr_tx = via_sr_tx,
                               .irq_set = via_irq_set,
+                              .ifr_set = via_ifr_flagged,
         };
+        struct sched_cb schcb = { .now = sched_now,
+                                  .deadline = sched_deadline,
+        };
+        sched_init(&schcb);
+        sched_register(SCHED_EVT_KBD, kbd_cmd_event);
+        sched_register(SCHED_EVT_MOUSE, mouse_tick);
+        sched_register(SCHED_EVT_VBL, vbl_event);
+        sched_register(SCHED_EVT_1HZ, onehz_event);
         via_init(&vcb);
         struct scc_cb scb = { .irq_set = scc_irq_set,
+                              .status_change = scc_status_changed,
         };
         scc_init(&scb);
         disc_init(discs);
@@ -590,12 +937,78 @@ int     umac_init(void *ram_base, void *rom_base, disc_descr_t discs[DISC_NUM_DR
 void    umac_opt_disassemble(int enable)
 {
         disassemble = enable;
+        instr_hook_update();
+}
+
+/* Stop umac_run_until() (given UMAC_RUN_BREAKPOINT in its mask) on
+ * reaching pc.  The hook runs just before each instruction, but
+ * can't prevent it, so the instruction at pc is executed before the
+ * run stops.  Needs the instruction hook (ENABLE_DASM).
+ * Returns 0 on success.
+ */
+int     umac_breakpoint_set(uint32_t pc)
+{
+#ifdef ENABLE_DASM
+        if (num_breakpoints >= UMAC_MAX_BREAKPOINTS)
+                return -1;
+        breakpoints[num_breakpoints++] = ADR24(pc);
+        instr_hook_update();
+        return 0;
+#else
+        (void)pc;
+        return -1;
+#endif
+}
+
+void    umac_breakpoint_clear(uint32_t pc)
+{
+        for (int i = 0; i < num_breakpoints; i++) {
+                if (breakpoints[i] == ADR24(pc))
+                        breakpoints[i--] = breakpoints[--num_breakpoints];
+        }
+        instr_hook_update();
+}
+
+/* Guest block execution profiling (see prof.c); enabling clears any
+ * previous counts.  Needs the instruction hook, i.e. ENABLE_DASM.
+ */
+void    umac_opt_profile(int enable)
+{
+#ifdef ENABLE_DASM
+        if (enable && !profile)
+                prof_reset();
+        profile = enable;
+        instr_hook_update();
+#else
+        (void)enable;
+#endif
+}
+
+void    umac_profile_dump(FILE *f)
+{
+#ifdef ENABLE_DASM
+        prof_dump(f);
+#else
+        (void)f;
+#endif
+}
+
+void    umac_profile_dump_ops(FILE *f)
+{
+#ifdef ENABLE_DASM
+        prof_dump_ops(f);
+#else
+        (void)f;
+#endif
 }
 
 #define MOUSE_MAX_PENDING_PIX   30
+#define MOUSE_STEP_US           1000
 
 static int pending_mouse_deltax = 0;
 static int pending_mouse_deltay = 0;
+static int mouse_old_dcd_a = 0;
+static int mouse_old_dcd_b = 0;
 
 /* Provide mouse input (movement, button) data.
  *
@@ -603,6 +1016,9 @@ static int pending_mouse_deltay = 0;
  */
 void    umac_mouse(int deltax, int deltay, int button)
 {
+        if (deltax || deltay || button != via_mouse_pressed)
+                idle_wake();
+
         pending_mouse_deltax += deltax;
         pending_mouse_deltay += deltay;
 
@@ -622,13 +1038,17 @@ void    umac_mouse(int deltax, int deltay, int button)
          * mismatch might be perceptible.
          */
         via_mouse_pressed = button;
+
+        if ((pending_mouse_deltax || pending_mouse_deltay) &&
+            !sched_pending(SCHED_EVT_MOUSE))
+                sched_post(SCHED_EVT_MOUSE, 0);
 }
 
 static void     mouse_tick(void)
 {
-        /* Periodically, check if the mouse X/Y deltas are non-zero.
-         * If a movement is required, encode one step in X and/or Y
-         * and deduct from the pending delta.
+        /* Scheduled every MOUSE_STEP_US while the mouse X/Y deltas are
+         * non-zero.  Encode one step in X and/or Y and deduct from the
+         * pending delta.
          *
          * The step ultimately posts an SCC IRQ, so we _don't_ try to
          * make any more steps while an IRQ is currently pending.
@@ -641,11 +1061,10 @@ static void     mouse_tick(void)
         if (pending_mouse_deltax == 0 && pending_mouse_deltay == 0)
                 return;
 
-        if (scc_irq_state == 1)
+        if (scc_irq_state == 1) {
+                sched_post(SCHED_EVT_MOUSE, MOUSE_STEP_US);
                 return;
-
-        static int old_dcd_a = 0;
-        static int old_dcd_b = 0;
+        }
 
         /* Mouse X/Y quadrature signals are wired to:
          *  VIA Port B[4] & SCC DCD_A for X
@@ -655,8 +1074,8 @@ static void     mouse_tick(void)
          * in one step, toggling existing DCD states and setting VIA
          * either equal or opposite to DCD:
          */
-        int dcd_a = old_dcd_a;
-        int dcd_b = old_dcd_b;
+        int dcd_a = mouse_old_dcd_a;
+        int dcd_b = mouse_old_dcd_b;
         int deltax = pending_mouse_deltax;
         int deltay = pending_mouse_deltay;
         uint8_t qb = via_quadbits;
@@ -677,14 +1096,20 @@ static void     mouse_tick(void)
         MDBG("\n");
 
         via_quadbits = qb;
-        old_dcd_a = dcd_a;
-        old_dcd_b = dcd_b;
+        mouse_old_dcd_a = dcd_a;
+        mouse_old_dcd_b = dcd_b;
         scc_set_dcd(dcd_a, dcd_b);
+
+        if (pending_mouse_deltax || pending_mouse_deltay)
+                sched_post(SCHED_EVT_MOUSE, MOUSE_STEP_US);
 }
 
 void    umac_reset(void)
 {
+        idle_wake();
         overlay = 1;
+        update_overlay_layout();
+        wd_os_up = 0;
         m68k_pulse_reset();
 }
 
@@ -698,22 +1123,748 @@ void    umac_disc_ejected(void)
 #endif
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Idle detection
+//
+// When the guest is just waiting for something to happen (an interrupt,
+// or input), there's no point running it flat out.  Two cases are
+// spotted, checked at the end of each execution quantum:
+//
+// - It's executed a STOP, i.e. is waiting for an interrupt.
+// - It's spinning in a polling loop: the PC has stayed within a few
+//   bytes, and no register (or SR) has changed, for several quanta.
+//   A loop doing actual work, e.g. a blit, changes pointers/counts.
+//
+// Once idle, umac_run_until() lets time pass without running the CPU, until
+// a device flags an event (an IRQ, or a masked one that might be being
+// polled: any VIA IFR bit, or SCC DCD change) or the frontend delivers
+// input/time events.
+
+#define M68K_INST_STOP          0x4e72
+#define IDLE_SPIN_WINDOW        64      /* Bytes */
+#define IDLE_SPIN_QUANTA        3
+#define IDLE_NUM_REGS           17      /* D0-D7, A0-A7, SR */
+
+static int idle = 0;
+static int idle_spin_count = 0;
+static uint32_t idle_spin_pc = 0;
+static uint32_t idle_spin_regs[IDLE_NUM_REGS];
+
+static void     idle_wake(void)
+{
+        idle = 0;
+        idle_spin_count = 0;
+}
+
+static void     idle_check(void)
+{
+        uint32_t pc = m68k_get_reg(NULL, M68K_REG_PPC);
+        uint32_t regs[IDLE_NUM_REGS];
+        int same = (pc - idle_spin_pc + IDLE_SPIN_WINDOW) < (2 * IDLE_SPIN_WINDOW);
+
+        if (cpu_read_instr_word(pc) == M68K_INST_STOP) {
+                MDBG("[Idle: STOP at %06x]\n", pc);
+                idle = 1;
+                return;
+        }
+
+        for (int i = 0; i < 16; i++) {
+                regs[i] = m68k_get_reg(NULL, M68K_REG_D0 + i);
+                same = same && (regs[i] == idle_spin_regs[i]);
+        }
+        regs[16] = m68k_get_reg(NULL, M68K_REG_SR);
+        same = same && (regs[16] == idle_spin_regs[16]);
+
+        if (same) {
+                if (++idle_spin_count >= IDLE_SPIN_QUANTA) {
+                        MDBG("[Idle: spinning at %06x]\n", pc);
+                        idle = 1;
+                }
+        } else {
+                idle_spin_count = 0;
+        }
+        idle_spin_pc = pc;
+        for (int i = 0; i < IDLE_NUM_REGS; i++)
+                idle_spin_regs[i] = regs[i];
+}
+
+/* If the guest is idle, returns the emulated time (in us, as per
+ * umac_get_time_us()) of the next internal event that'll wake it, or
+ * UMAC_IDLE_FOREVER if only an external event (vsync/1Hz/input) will.
+ * Returns 0 if the guest is busy.
+ */
+uint64_t        umac_idle_until(void)
+{
+        uint64_t next = sched_next();
+
+        if (!idle)
+                return 0;
+        return (next == SCHED_NEVER) ? UMAC_IDLE_FOREVER : next;
+}
+
+uint64_t        umac_get_time_us(void)
+{
+        return global_time_us;
+}
+
+/* The frontend's passage-of-time events: */
+void    umac_vsync_event(void)
+{
+        watchdog_vbl();
+        idle_wake();
+        via_caX_event(2);
+        run_event(UMAC_RUN_VBL);
+        vbl_latched = 1;
+}
+
+void    umac_1hz_event(void)
+{
+        idle_wake();
+        via_caX_event(1);
+}
+
+/* Alternatively, the core generates these itself from emulated time
+ * (see umac_opt_internal_timing()).  That's deterministic, and isn't
+ * tied to wallclock, so can run as fast as the host allows.
+ *
+ * A frame is 370 lines of 704 dots at 15.6672MHz, i.e. ~16.626ms
+ * (60.15Hz).  The time of VBL n is kept exact, as
+ * vbl_base + n * VBL_PERIOD_NUM / VBL_PERIOD_DEN us.
+ */
+#define VBL_PERIOD_NUM          (370ULL * 704 * 10000)
+#define VBL_PERIOD_DEN          156672
+
+static int internal_timing = 0;
+static uint64_t vbl_base = 0;
+static uint64_t vbl_count = 0;
+
+static void     vbl_post_next(void)
+{
+        sched_post_at(SCHED_EVT_VBL,
+                      vbl_base + (vbl_count + 1) * VBL_PERIOD_NUM / VBL_PERIOD_DEN);
+}
+
+static void     vbl_event(void)
+{
+        vbl_count++;
+        vbl_post_next();
+        umac_vsync_event();
+}
+
+static void     onehz_event(void)
+{
+        sched_post(SCHED_EVT_1HZ, 1000000);
+        umac_1hz_event();
+}
+
+/* Call after umac_init().  When enabled, the frontend should no longer
+ * call umac_vsync_event()/umac_1hz_event().
+ */
+void    umac_opt_internal_timing(int enable)
+{
+        if (!!enable == internal_timing)
+                return;
+        internal_timing = !!enable;
+        if (enable) {
+                vbl_base = global_time_us;
+                vbl_count = 0;
+                vbl_post_next();
+                sched_post(SCHED_EVT_1HZ, 1000000);
+        } else {
+                sched_cancel(SCHED_EVT_VBL);
+                sched_cancel(SCHED_EVT_1HZ);
+        }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CPU slices
+//
+// The CPU runs in slices ending at the next scheduled event (or the
+// end of the umac_run_until() budget).  If a device posts an event for
+// sooner than that whilst the CPU's running, the slice is cut short
+// with m68k_end_timeslice().
+
+static int cpu_running = 0;
+static int cpu_slice_ended = 0;
+static int cpu_slice_used = 0;
+static uint64_t cpu_slice_end = 0;
+
+static void     time_add_cycles(uint64_t cycles)
+{
+#if UMAC_CYCLE_COUNTING
+        global_clocks += cycles * CPU_BUS_SHARE_DEN / CPU_BUS_SHARE_NUM;
+        global_time_us = global_clocks * 1000000 / CPU_CLOCK_HZ;
+#else
+        cycles += global_cycles_frac;
+        global_time_us += cycles / 8;
+        global_cycles_frac = cycles % 8;
+#endif
+}
+
+static void     time_advance_to(uint64_t time)
+{
+#if UMAC_CYCLE_COUNTING
+        global_clocks = (time * CPU_CLOCK_HZ + 999999) / 1000000;
+        global_time_us = global_clocks * 1000000 / CPU_CLOCK_HZ;
+#else
+        global_time_us = time;
+        global_cycles_frac = 0;
+#endif
+}
+
+static uint64_t sched_now(void)
+{
+        if (!cpu_running)
+                return global_time_us;
+        return global_time_us +
+                CPU_CYCLES_TO_US(cpu_slice_ended ? cpu_slice_used : m68k_cycles_run());
+}
+
+static void     cpu_end_slice(void)
+{
+        if (cpu_running && !cpu_slice_ended) {
+                cpu_slice_used = m68k_cycles_run();
+                cpu_slice_ended = 1;
+                m68k_end_timeslice();
+        }
+}
+
+static void     sched_deadline(uint64_t time)
+{
+        if (time < cpu_slice_end)
+                cpu_end_slice();
+}
+
+static void     cpu_run_until(uint64_t time)
+{
+        uint64_t cycles;
+        int used;
+
+        if (idle) {
+                time_advance_to(time);
+                return;
+        }
+        cycles = CPU_US_TO_CYCLES(time - global_time_us);
+        cpu_slice_end = time;
+        cpu_slice_ended = 0;
+        cpu_running = 1;
+        /* Overshoots the budget by the tail of the last instruction */
+        used = m68k_execute(cycles ? cycles : 1);
+        cpu_running = 0;
+        /* m68k_end_timeslice() upsets m68k_execute()'s return value */
+        if (cpu_slice_ended)
+                used = cpu_slice_used;
+        time_add_cycles(used);
+}
+
+/* Something happened that might end umac_run_until() early: */
+static void     run_event(int reason)
+{
+        if (run_reason >= 0 || !(run_stop_on & UMAC_STOP_ON(reason)))
+                return;
+        run_reason = reason;
+        cpu_end_slice();
+}
+
+static uint64_t idle_check_time = 0;
+
+/* Run the emulator for up to budget_us of emulated time, stopping
+ * early on any of the events in stop_on (a mask of
+ * UMAC_STOP_ON(UMAC_RUN_x)).  Returns the UMAC_RUN_x reason, and the
+ * emulated time consumed in *elapsed_us (if non-NULL).
+ *
+ * Events are noticed at the end of the instruction that caused them;
+ * an idle stop is reported when the guest becomes idle, not for a
+ * guest that's still idle from before.  A VBL raised by the frontend
+ * (umac_vsync_event()) since the last run is reported straight away.
+ */
+int     umac_run_until(uint64_t budget_us, unsigned int stop_on, uint64_t *elapsed_us)
+{
+        uint64_t start = global_time_us;
+        uint64_t end = start + budget_us;
+        int watch_fb = !!(stop_on & UMAC_STOP_ON(UMAC_RUN_FB));
+
+        if (watch_fb != mem_watch_fb) {
+                mem_watch_fb = watch_fb;
+                mem_map_build();
+        }
+        run_stop_on = stop_on;
+        run_reason = -1;
+        /* Not yet collected with umac_watchdog_get(): */
+        if (wd_event.reason != UMAC_WD_NONE)
+                run_event(UMAC_RUN_WATCHDOG);
+        /* The frontend's umac_vsync_event() comes between runs: */
+        if (vbl_latched)
+                run_event(UMAC_RUN_VBL);
+        vbl_latched = 0;
+
+        if (setjmp(main_loop_jb)) {
+                cpu_running = 0;
+                exit_error_guard = 0;
+        } else {
+                while (!sim_done && run_reason < 0 && global_time_us < end) {
+                        uint64_t next = sched_next();
+
+                        if (next > end)
+                                next = end;
+                        if (next > idle_check_time)
+                                next = idle_check_time;
+                        if (next > global_time_us)
+                                cpu_run_until(next);
+                        sched_run(global_time_us);
+
+                        if (global_time_us >= idle_check_time) {
+                                idle_check_time = global_time_us + UMAC_EXECLOOP_QUANTUM;
+                                if (!idle) {
+                                        idle_check();
+                                        if (idle)
+                                                run_event(UMAC_RUN_IDLE);
+                                }
+                        }
+                }
+        }
+        run_stop_on = 0;
+        vbl_latched = 0;
+
+        if (elapsed_us)
+                *elapsed_us = global_time_us - start;
+        if (sim_done)
+                return UMAC_RUN_DONE;
+        return (run_reason >= 0) ? run_reason : UMAC_RUN_BUDGET;
+}
+
 /* Run the emulator for about a frame.
  * Returns 0 for not-done, 1 when an exit/done condition arises.
  */
 int     umac_loop(void)
 {
-        setjmp(main_loop_jb);
+        return umac_run_until(UMAC_EXECLOOP_QUANTUM, 0, NULL) == UMAC_RUN_DONE;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Multiple instances
+//
+// Musashi keeps the CPU in globals, and the fast memory paths in cpu_cb.h
+// use the global memory map, so a process has one "current" machine.  To
+// run several, each umac_t holds the state of a parked machine; on
+// umac_select() the current machine's state (CPU context, devices, the
+// bits of this file below) is saved to its umac_t and the new one's is
+// loaded.  Selecting costs a few KB of copying, and the single-instance
+// paths are unchanged.
+//
+// Debug options, breakpoints and profiling apply to the process, not to
+// an instance.
+
+struct core_state {
+        uint8_t *ram_base;
+        uint8_t *rom_base;
+        disc_descr_t discs[DISC_NUM_DRIVES];
+        int overlay;
+        uint64_t global_time_us;
+        int sim_done;
+#if UMAC_CYCLE_COUNTING
+        uint64_t global_clocks;
+#else
+        unsigned int global_cycles_frac;
+#endif
+        uint8_t via_ra_oldval;
+        uint8_t via_quadbits;
+        uint8_t via_mouse_pressed;
+        int kbd_last_cmd;
+        int kbd_pending_evt;
+        int scc_irq_state;
+        uint8_t iwm_regs[16];
+        int pending_mouse_deltax;
+        int pending_mouse_deltay;
+        int mouse_old_dcd_a;
+        int mouse_old_dcd_b;
+        int idle;
+        int idle_spin_count;
+        uint32_t idle_spin_pc;
+        uint32_t idle_spin_regs[IDLE_NUM_REGS];
+        int internal_timing;
+        uint64_t vbl_base;
+        uint64_t vbl_count;
+        uint64_t idle_check_time;
+        int vbl_latched;
+        int mem_watch_fb;
+        int mem_track_dirty;
+        uint8_t ram_dirty[UMAC_RAM_NUM_PAGES];
+        unsigned int wd_stall_vbls;
+        unsigned int wd_vbls;
+        uint32_t wd_ticks;
+        uint64_t wd_ticks_time;
+        uint64_t wd_check_time;
+        int wd_os_up;
+        uint16_t wd_errcode;
+        umac_watchdog_t wd_event;
+};
+
+struct umac {
+        int valid;              /* Has been selected & initialised */
+        struct core_state core;
+        void *cpu;
+        void *via;
+        void *scc;
+        void *sched;
+        void *disc;
+};
+
+static umac_t *umac_current = NULL;
+
+static void     core_state_save(struct core_state *c)
+{
+        c->ram_base = _ram_base;
+        c->rom_base = _rom_base;
+        memcpy(c->discs, umac_discs, sizeof(umac_discs));
+        c->overlay = overlay;
+        c->global_time_us = global_time_us;
+        c->sim_done = sim_done;
+#if UMAC_CYCLE_COUNTING
+        c->global_clocks = global_clocks;
+#else
+        c->global_cycles_frac = global_cycles_frac;
+#endif
+        c->via_ra_oldval = via_ra_oldval;
+        c->via_quadbits = via_quadbits;
+        c->via_mouse_pressed = via_mouse_pressed;
+        c->kbd_last_cmd = kbd_last_cmd;
+        c->kbd_pending_evt = kbd_pending_evt;
+        c->scc_irq_state = scc_irq_state;
+        memcpy(c->iwm_regs, iwm_regs, sizeof(iwm_regs));
+        c->pending_mouse_deltax = pending_mouse_deltax;
+        c->pending_mouse_deltay = pending_mouse_deltay;
+        c->mouse_old_dcd_a = mouse_old_dcd_a;
+        c->mouse_old_dcd_b = mouse_old_dcd_b;
+        c->idle = idle;
+        c->idle_spin_count = idle_spin_count;
+        c->idle_spin_pc = idle_spin_pc;
+        memcpy(c->idle_spin_regs, idle_spin_regs, sizeof(idle_spin_regs));
+        c->internal_timing = internal_timing;
+        c->vbl_base = vbl_base;
+        c->vbl_count = vbl_count;
+        c->idle_check_time = idle_check_time;
+        c->vbl_latched = vbl_latched;
+        c->mem_watch_fb = mem_watch_fb;
+        c->mem_track_dirty = mem_track_dirty;
+        memcpy(c->ram_dirty, ram_dirty, sizeof(ram_dirty));
+        c->wd_stall_vbls = wd_stall_vbls;
+        c->wd_vbls = wd_vbls;
+        c->wd_ticks = wd_ticks;
+        c->wd_ticks_time = wd_ticks_time;
+        c->wd_check_time = wd_check_time;
+        c->wd_os_up = wd_os_up;
+        c->wd_errcode = wd_errcode;
+        c->wd_event = wd_event;
+}
+
+static void     core_state_load(const struct core_state *c)
+{
+        _ram_base = c->ram_base;
+        _rom_base = c->rom_base;
+        memcpy(umac_discs, c->discs, sizeof(umac_discs));
+        overlay = c->overlay;
+        global_time_us = c->global_time_us;
+        sim_done = c->sim_done;
+#if UMAC_CYCLE_COUNTING
+        global_clocks = c->global_clocks;
+#else
+        global_cycles_frac = c->global_cycles_frac;
+#endif
+        via_ra_oldval = c->via_ra_oldval;
+        via_quadbits = c->via_quadbits;
+        via_mouse_pressed = c->via_mouse_pressed;
+        kbd_last_cmd = c->kbd_last_cmd;
+        kbd_pending_evt = c->kbd_pending_evt;
+        scc_irq_state = c->scc_irq_state;
+        memcpy(iwm_regs, c->iwm_regs, sizeof(iwm_regs));
+        pending_mouse_deltax = c->pending_mouse_deltax;
+        pending_mouse_deltay = c->pending_mouse_deltay;
+        mouse_old_dcd_a = c->mouse_old_dcd_a;
+        mouse_old_dcd_b = c->mouse_old_dcd_b;
+        idle = c->idle;
+        idle_spin_count = c->idle_spin_count;
+        idle_spin_pc = c->idle_spin_pc;
+        memcpy(idle_spin_regs, c->idle_spin_regs, sizeof(idle_spin_regs));
+        internal_timing = c->internal_timing;
+        vbl_base = c->vbl_base;
+        vbl_count = c->vbl_count;
+        idle_check_time = c->idle_check_time;
+        vbl_latched = c->vbl_latched;
+        mem_watch_fb = c->mem_watch_fb;
+        mem_track_dirty = c->mem_track_dirty;
+        memcpy(ram_dirty, c->ram_dirty, sizeof(ram_dirty));
+        wd_stall_vbls = c->wd_stall_vbls;
+        wd_vbls = c->wd_vbls;
+        wd_ticks = c->wd_ticks;
+        wd_ticks_time = c->wd_ticks_time;
+        wd_check_time = c->wd_check_time;
+        wd_os_up = c->wd_os_up;
+        wd_errcode = c->wd_errcode;
+        wd_event = c->wd_event;
+}
+
+/* Back to power-on values, for umac_init() */
+static void     core_state_reset(void)
+{
+        static const struct core_state c = {
+                .overlay = 1,
+                .via_ra_oldval = 0x10,
+                .kbd_pending_evt = -1,
+        };
+        core_state_load(&c);
+}
 
-        const int us = UMAC_EXECLOOP_QUANTUM;
-        m68k_execute(us*8);
-        global_time_us += us;
+/* Returns a new (unselected) instance, or NULL if out of memory. */
+umac_t  *umac_new(void)
+{
+        umac_t *u = calloc(1, sizeof(*u));
+
+        if (!u)
+                return NULL;
+        u->cpu = calloc(1, m68k_context_size());
+        u->via = calloc(1, via_state_size());
+        u->scc = calloc(1, scc_state_size());
+        u->sched = calloc(1, sched_state_size());
+        u->disc = calloc(1, disc_state_size());
+        if (!u->cpu || !u->via || !u->scc || !u->sched || !u->disc) {
+                umac_free(u);
+                return NULL;
+        }
+        return u;
+}
 
-        // Device polling
-        via_tick(global_time_us);
-        mouse_tick();
-        kbd_check_work();
+void    umac_free(umac_t *u)
+{
+        if (!u)
+                return;
+        if (u == umac_current)
+                umac_current = NULL;
+        free(u->cpu);
+        free(u->via);
+        free(u->scc);
+        free(u->sched);
+        free(u->disc);
+        free(u);
+}
 
-	return sim_done;
+/* Make u the current machine, which all other umac_*() calls then act
+ * on.  A new instance must then be set up with umac_init() (and any
+ * umac_opt_*()), as for a single machine.  Don't call this from within
+ * umac_run_until() (e.g. from a frontend callback).
+ */
+void    umac_select(umac_t *u)
+{
+        if (u == umac_current)
+                return;
+
+        if (umac_current) {
+                core_state_save(&umac_current->core);
+                m68k_get_context(umac_current->cpu);
+                via_state_save(umac_current->via);
+                scc_state_save(umac_current->scc);
+                sched_state_save(umac_current->sched);
+                disc_state_save(umac_current->disc);
+                umac_current->valid = 1;
+        }
+        umac_current = u;
+
+        if (u && u->valid) {
+                core_state_load(&u->core);
+                m68k_set_context(u->cpu);
+                via_state_load(u->via);
+                scc_state_load(u->scc);
+                sched_state_load(u->sched);
+                disc_state_load(u->disc);
+                disc_reattach(umac_discs);
+                update_overlay_layout();
+        }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Snapshots
+//
+// Like umac_select(), but the state might be loaded by another process,
+// or another build of this one.  So, no host pointers: the CPU is saved
+// as registers rather than a Musashi context, and RAM/ROM/disc pointers
+// are supplied at restore.  The header catches incompatible builds.
+
+#define SNAPSHOT_MAGIC          0x756d6163      /* "umac" */
+#define SNAPSHOT_VERSION        6
+
+#define SNAPSHOT_F_SWIZZLE      0x01
+#define SNAPSHOT_F_CYCLES       0x02
+
+/* Restored in this order: SR first, as it switches stack pointers */
+static const m68k_register_t snapshot_regs[] = {
+        M68K_REG_SR, M68K_REG_USP, M68K_REG_ISP,
+        M68K_REG_D0, M68K_REG_D1, M68K_REG_D2, M68K_REG_D3,
+        M68K_REG_D4, M68K_REG_D5, M68K_REG_D6, M68K_REG_D7,
+        M68K_REG_A0, M68K_REG_A1, M68K_REG_A2, M68K_REG_A3,
+        M68K_REG_A4, M68K_REG_A5, M68K_REG_A6, M68K_REG_A7,
+        M68K_REG_PPC, M68K_REG_PC,
+};
+#define SNAPSHOT_NUM_REGS       (sizeof(snapshot_regs) / sizeof(snapshot_regs[0]))
+
+struct snapshot_hdr {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t flags;
+        uint32_t ram_size;
+        uint32_t size;
+        uint32_t regs[SNAPSHOT_NUM_REGS];
+        struct core_state core;
+};
+/* ...followed by VIA, SCC, scheduler and disc state */
+
+size_t  umac_snapshot_size(void)
+{
+        return sizeof(struct snapshot_hdr) + via_state_size() + scc_state_size() +
+                sched_state_size() + disc_state_size();
+}
+
+static uint32_t snapshot_flags(void)
+{
+        uint32_t f = 0;
+#if UMAC_RAM_SWIZZLE
+        f |= SNAPSHOT_F_SWIZZLE;
+#endif
+#if UMAC_CYCLE_COUNTING
+        f |= SNAPSHOT_F_CYCLES;
+#endif
+        return f;
+}
+
+void    umac_snapshot_save(void *buf)
+{
+        struct snapshot_hdr *h = buf;
+        uint8_t *p = (uint8_t *)(h + 1);
+
+        memset(h, 0, sizeof(*h));
+        h->magic = SNAPSHOT_MAGIC;
+        h->version = SNAPSHOT_VERSION;
+        h->flags = snapshot_flags();
+        h->ram_size = RAM_SIZE;
+        h->size = umac_snapshot_size();
+        for (unsigned int i = 0; i < SNAPSHOT_NUM_REGS; i++)
+                h->regs[i] = m68k_get_reg(NULL, snapshot_regs[i]);
+
+        /* Musashi's "stopped" state isn't visible, but a CPU that's
+         * stopped sits just after its STOP.  Resume at the STOP, which
+         * stops again (with the same SR, which STOP loaded):
+         */
+        uint32_t pc = m68k_get_reg(NULL, M68K_REG_PC);
+        uint32_t ppc = m68k_get_reg(NULL, M68K_REG_PPC);
+        if (pc == ppc + 4 && cpu_read_instr_word(ppc) == M68K_INST_STOP)
+                h->regs[SNAPSHOT_NUM_REGS - 1] = ppc;
+
+        core_state_save(&h->core);
+        h->core.ram_base = NULL;
+        h->core.rom_base = NULL;
+        memset(h->core.discs, 0, sizeof(h->core.discs));
+        /* Host-side memory watching isn't part of the machine: */
+        h->core.mem_watch_fb = 0;
+        h->core.mem_track_dirty = 0;
+        memset(h->core.ram_dirty, 0, sizeof(h->core.ram_dirty));
+
+        via_state_save(p);
+        p += via_state_size();
+        scc_state_save(p);
+        p += scc_state_size();
+        sched_state_save(p);
+        p += sched_state_size();
+        disc_state_save(p);
+}
+
+int     umac_snapshot_check(const void *buf)
+{
+        const struct snapshot_hdr *h = buf;
+
+        if (h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION ||
+            h->flags != snapshot_flags() || h->ram_size != RAM_SIZE ||
+            h->size != umac_snapshot_size()) {
+                MERR("Snapshot doesn't match this build\n");
+                return -1;
+        }
+        return 0;
+}
+
+int     umac_snapshot_load(const void *buf)
+{
+        const struct snapshot_hdr *h = buf;
+        const uint8_t *p = (const uint8_t *)(h + 1);
+        uint8_t *ram_base = _ram_base;
+        uint8_t *rom_base = _rom_base;
+        disc_descr_t discs[DISC_NUM_DRIVES];
+        int watch_fb = mem_watch_fb;
+        int track_dirty = mem_track_dirty;
+        uint8_t dirty[UMAC_RAM_NUM_PAGES];
+
+        if (umac_snapshot_check(h))
+                return -1;
+
+        /* Reset to clear Musashi's hidden state, in particular a STOP
+         * from before the load (a saved STOP is re-executed, see
+         * umac_snapshot_save()), then overwrite the registers:
+         */
+        m68k_pulse_reset();
+        for (unsigned int i = 0; i < SNAPSHOT_NUM_REGS; i++)
+                m68k_set_reg(snapshot_regs[i], h->regs[i]);
+
+        /* Keep this machine's memories, and how they're watched: */
+        memcpy(discs, umac_discs, sizeof(discs));
+        memcpy(dirty, ram_dirty, sizeof(dirty));
+        core_state_load(&h->core);
+        _ram_base = ram_base;
+        _rom_base = rom_base;
+        memcpy(umac_discs, discs, sizeof(umac_discs));
+        mem_watch_fb = watch_fb;
+        mem_track_dirty = track_dirty;
+        memcpy(ram_dirty, dirty, sizeof(ram_dirty));
+
+        via_state_load(p);
+        p += via_state_size();
+        scc_state_load(p);
+        p += scc_state_size();
+        sched_state_load(p);
+        p += sched_state_size();
+        disc_state_load(p);
+        disc_reattach(umac_discs);
+
+        update_overlay_layout();
+        /* The CPU's IRQ inputs aren't in the saved registers, so
+         * drive them from the devices again:
+         */
+        m68k_set_virq(1, via_irq_status());
+        m68k_set_virq(2, scc_irq_state);
+        return 0;
+}
+
+int     umac_snapshot_restore(const void *buf, void *ram_base, void *rom_base,
+                              disc_descr_t discs[DISC_NUM_DRIVES])
+{
+        if (umac_snapshot_check(buf))
+                return -1;
+
+        /* Set up callbacks etc. as usual, then overwrite the state: */
+        umac_init(ram_base, rom_base, discs);
+        return umac_snapshot_load(buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// RAM dirty tracking
+
+void    umac_opt_track_dirty(int enable)
+{
+        mem_track_dirty = !!enable;
+        memset(ram_dirty, 0, sizeof(ram_dirty));
+        mem_map_build();
+}
+
+void    umac_ram_dirty_collect(uint8_t dirty[UMAC_RAM_NUM_PAGES])
+{
+        memcpy(dirty, ram_dirty, sizeof(ram_dirty));
+        memset(ram_dirty, 0, sizeof(ram_dirty));
+        mem_map_build();
+}
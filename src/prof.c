@@ -0,0 +1,281 @@
+/* umac guest execution profiler
+ *
+ * Optional (enabled at runtime) profiling, driven from the per-
+ * instruction hook.  This counts executions of guest "blocks": a
+ * block here is a run of sequential instructions entered via a
+ * branch/jump/exception, keyed by its start PC.  The dump gives an
+ * idea of where guest time goes (ROM QuickDraw loops, etc.), which is
+ * useful before trying to optimise the CPU core for a workload.
+ *
+ * It also counts pairs of opcodes executed back-to-back (i.e. the
+ * second sequentially following the first, such as cmp+bcc or
+ * tst+beq), as candidates for fused handlers.
+ *
+ * Finally, a histogram of raw opcodes and pairs can be dumped for
+ * tools/hot_ops.py and tools/hot_pairs.py, which map them onto
+ * Musashi's handlers to regenerate the tools/fn_hot200.txt hot list
+ * and tools/fuse_pairs.txt list of handlers to fuse.
+ *
+ * This needs the disassembler (ENABLE_DASM) to find instruction
+ * lengths.  On the 68000 the length follows from the opcode word
+ * alone, so that's only done the first time each opcode is seen.
+ * It's still slow-ish: it's not intended to be left on.
+ *
+ * Copyright 2024 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "m68k.h"
+#include "machw.h"
+#include "prof.h"
+
+#define PROF_NUM_BLOCKS         16384   /* Po2 */
+#define PROF_NUM_PAIRS          32768   /* Po2 */
+#define PROF_DUMP_TOP           40
+
+struct prof_block {
+        uint32_t pc;
+        uint32_t execs;
+        uint64_t instrs;
+};
+
+struct prof_pair {
+        uint32_t ops;           /* First opcode in [31:16], second [15:0] */
+        uint32_t pc;            /* Example location, for disassembly */
+        uint64_t count;
+};
+
+static struct prof_block prof_blocks[PROF_NUM_BLOCKS];
+static struct prof_pair prof_pairs[PROF_NUM_PAIRS];
+static uint64_t prof_ops[65536];
+static uint8_t prof_op_len[65536];      /* Bytes, 0 = not seen yet */
+static unsigned int prof_npairs = 0;
+static uint64_t prof_total_pairs = 0;
+static uint32_t prof_last_op = 0;
+static uint32_t prof_last_pc = 0;
+static unsigned int prof_nblocks = 0;
+static uint64_t prof_total_instrs = 0;
+static uint64_t prof_lost_instrs = 0;
+static uint32_t prof_next_pc = 0xffffffff;
+static struct prof_block *prof_cur = NULL;
+
+static struct prof_block *prof_lookup(uint32_t pc)
+{
+        unsigned int h = (pc >> 1) * 2654435761u;
+
+        for (unsigned int i = 0; i < PROF_NUM_BLOCKS; i++) {
+                struct prof_block *b = &prof_blocks[(h + i) & (PROF_NUM_BLOCKS - 1)];
+
+                if (b->execs && b->pc == pc)
+                        return b;
+                if (!b->execs) {
+                        b->pc = pc;
+                        prof_nblocks++;
+                        return b;
+                }
+        }
+        return NULL;    /* Full */
+}
+
+static void     prof_pair(uint32_t ops, uint32_t pc)
+{
+        unsigned int h = ops * 2654435761u;
+
+        prof_total_pairs++;
+        for (unsigned int i = 0; i < PROF_NUM_PAIRS; i++) {
+                struct prof_pair *p = &prof_pairs[(h + i) & (PROF_NUM_PAIRS - 1)];
+
+                if (p->count && p->ops == ops) {
+                        p->count++;
+                        return;
+                }
+                if (!p->count) {
+                        p->ops = ops;
+                        p->pc = pc;
+                        p->count = 1;
+                        prof_npairs++;
+                        return;
+                }
+        }
+        /* Full, drop it */
+}
+
+void    prof_reset(void)
+{
+        memset(prof_blocks, 0, sizeof(prof_blocks));
+        memset(prof_pairs, 0, sizeof(prof_pairs));
+        memset(prof_ops, 0, sizeof(prof_ops));
+        prof_npairs = 0;
+        prof_total_pairs = 0;
+        prof_nblocks = 0;
+        prof_total_instrs = 0;
+        prof_lost_instrs = 0;
+        prof_next_pc = 0xffffffff;
+        prof_last_op = 0;
+        prof_last_pc = 0;
+        prof_cur = NULL;
+}
+
+void    prof_instr(unsigned int pc)
+{
+        uint32_t op;
+
+        pc = ADR24(pc);
+        op = cpu_read_instr_word(pc);
+        if (pc != prof_next_pc || !prof_cur) {
+                prof_cur = prof_lookup(pc);
+                if (prof_cur)
+                        prof_cur->execs++;
+        } else {
+                prof_pair((prof_last_op << 16) | op, prof_last_pc);
+        }
+        prof_ops[op]++;
+        prof_last_op = op;
+        prof_last_pc = pc;
+        if (prof_cur)
+                prof_cur->instrs++;
+        else
+                prof_lost_instrs++;
+        prof_total_instrs++;
+
+        if (!prof_op_len[op]) {
+                char buff[100];
+
+                prof_op_len[op] = m68k_disassemble(buff, pc, M68K_CPU_TYPE_68000);
+        }
+        prof_next_pc = pc + prof_op_len[op];
+}
+
+static int      prof_cmp_instrs(const void *a, const void *b)
+{
+        const struct prof_block *ba = a;
+        const struct prof_block *bb = b;
+
+        if (ba->instrs == bb->instrs)
+                return 0;
+        return (ba->instrs < bb->instrs) ? 1 : -1;
+}
+
+static int      prof_cmp_count(const void *a, const void *b)
+{
+        const struct prof_pair *pa = a;
+        const struct prof_pair *pb = b;
+
+        if (pa->count == pb->count)
+                return 0;
+        return (pa->count < pb->count) ? 1 : -1;
+}
+
+static void     prof_dump_pairs(FILE *f)
+{
+        struct prof_pair *sorted;
+        unsigned int n = 0;
+        char buff[100];
+        char buff2[100];
+
+        sorted = malloc(sizeof(struct prof_pair) * prof_npairs);
+        if (!sorted)
+                return;
+        for (unsigned int i = 0; i < PROF_NUM_PAIRS; i++) {
+                if (prof_pairs[i].count)
+                        sorted[n++] = prof_pairs[i];
+        }
+        qsort(sorted, n, sizeof(struct prof_pair), prof_cmp_count);
+
+        fprintf(f, "Opcode pairs: %" PRIu64 " sequential pairs, %u unique\n",
+                prof_total_pairs, n);
+        fprintf(f, "  ops            count       %%    (e.g. at)\n");
+        for (unsigned int i = 0; i < n && i < PROF_DUMP_TOP; i++) {
+                /* Code might since have been overwritten if in RAM, so
+                 * only disassemble if it's still the same:
+                 */
+                uint32_t pc = sorted[i].pc;
+                unsigned int len = m68k_disassemble(buff, pc, M68K_CPU_TYPE_68000);
+                if (cpu_read_instr_word(pc) == (sorted[i].ops >> 16) &&
+                    cpu_read_instr_word(pc + len) == (sorted[i].ops & 0xffff)) {
+                        m68k_disassemble(buff2, pc + len, M68K_CPU_TYPE_68000);
+                } else {
+                        buff[0] = buff2[0] = '\0';
+                }
+                fprintf(f, "  %04x %04x %12" PRIu64 " %6.2f   %06x: %s; %s\n",
+                        sorted[i].ops >> 16, sorted[i].ops & 0xffff, sorted[i].count,
+                        100.0 * sorted[i].count / prof_total_pairs,
+                        pc, buff, buff2);
+        }
+        free(sorted);
+}
+
+void    prof_dump(FILE *f)
+{
+        struct prof_block *sorted;
+        unsigned int n = 0;
+        uint64_t cumulative = 0;
+
+        if (!prof_total_instrs)
+                return;
+
+        sorted = malloc(sizeof(struct prof_block) * prof_nblocks);
+        if (!sorted)
+                return;
+        for (unsigned int i = 0; i < PROF_NUM_BLOCKS; i++) {
+                if (prof_blocks[i].execs)
+                        sorted[n++] = prof_blocks[i];
+        }
+        qsort(sorted, n, sizeof(struct prof_block), prof_cmp_instrs);
+
+        fprintf(f, "Profile: %" PRIu64 " instructions, %u blocks (%" PRIu64 " instrs untracked)\n",
+                prof_total_instrs, n, prof_lost_instrs);
+        fprintf(f, "  PC       execs      instrs       avg   %%     cum%%\n");
+        for (unsigned int i = 0; i < n && i < PROF_DUMP_TOP; i++) {
+                cumulative += sorted[i].instrs;
+                fprintf(f, "  %06x %10u %12" PRIu64 " %6.1f %6.2f %6.2f\n",
+                        sorted[i].pc, sorted[i].execs, sorted[i].instrs,
+                        (double)sorted[i].instrs / sorted[i].execs,
+                        100.0 * sorted[i].instrs / prof_total_instrs,
+                        100.0 * cumulative / prof_total_instrs);
+        }
+        free(sorted);
+
+        prof_dump_pairs(f);
+}
+
+/* One "<opcode hex> <count>" line per opcode executed, for
+ * tools/hot_ops.py, then "<opcode hex> <opcode hex> <count>" per
+ * sequential pair, for tools/hot_pairs.py:
+ */
+void    prof_dump_ops(FILE *f)
+{
+        for (unsigned int i = 0; i < 65536; i++) {
+                if (prof_ops[i])
+                        fprintf(f, "%04x %" PRIu64 "\n", i, prof_ops[i]);
+        }
+        for (unsigned int i = 0; i < PROF_NUM_PAIRS; i++) {
+                if (prof_pairs[i].count)
+                        fprintf(f, "%04x %04x %" PRIu64 "\n", prof_pairs[i].ops >> 16,
+                                prof_pairs[i].ops & 0xffff, prof_pairs[i].count);
+        }
+}
@@ -0,0 +1,333 @@
+/*
+ * Input recording and replay
+ *
+ * The core is deterministic: given the same sequence of calls (input
+ * events, and runs of the same length) it ends up in the same state.
+ * So, a recording is just that sequence, with each call's parameters.
+ * Emulated time isn't stored per event, as it follows from the runs;
+ * instead, every REPLAY_HASH_US of emulated time a hash of the machine
+ * state (CPU, devices, time, screen) is stored, so that playback can
+ * spot divergence (e.g. a different ROM, disc or build) when it occurs.
+ *
+ * Records are an opcode byte then arguments, as LEB128 varints:
+ *
+ *      REC_RUN                         Run, same budget/mask as last
+ *      REC_RUN_PARAMS budget stop_on   Run with new budget/mask
+ *      REC_KBD scancode down
+ *      REC_MOUSE dx dy button          dx/dy zigzag-encoded
+ *      REC_VSYNC
+ *      REC_1HZ
+ *      REC_HASH time_us hash           After the run it follows
+ *
+ * Copyright 2024 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "umac.h"
+#include "machw.h"
+#include "replay.h"
+
+#define REPLAY_MAGIC            "umacrec1"
+#define REPLAY_HASH_US          16667   /* About a frame */
+
+enum {
+        REC_RUN = 1,
+        REC_RUN_PARAMS,
+        REC_KBD,
+        REC_MOUSE,
+        REC_VSYNC,
+        REC_1HZ,
+        REC_HASH,
+};
+
+static FILE *rec_file = NULL;
+static FILE *play_file = NULL;
+static uint64_t run_budget = 0;
+static unsigned int run_stop_on = 0;
+static int last_button = 0;
+static uint64_t next_hash = 0;
+static uint8_t *hash_buf = NULL;
+
+/* FNV-1a over the machine state and screen */
+static uint32_t state_hash(void)
+{
+        size_t len = umac_snapshot_size();
+        uint8_t *fb = ram_get_base() + umac_get_fb_offset();
+        uint32_t h = 2166136261u;
+
+        umac_snapshot_save(hash_buf);
+        for (size_t i = 0; i < len; i++) {
+                h ^= hash_buf[i];
+                h *= 16777619u;
+        }
+        for (unsigned int i = 0; i < DISP_WIDTH * DISP_HEIGHT / 8; i++) {
+                h ^= fb[MEM_BYTE_ADDR(i)];
+                h *= 16777619u;
+        }
+        return h;
+}
+
+static void     put_varint(uint64_t v)
+{
+        do {
+                uint8_t b = v & 0x7f;
+                v >>= 7;
+                fputc(b | (v ? 0x80 : 0), rec_file);
+        } while (v);
+}
+
+static int      get_varint(uint64_t *v)
+{
+        *v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+                int b = fgetc(play_file);
+                if (b == EOF)
+                        return -1;
+                *v |= (uint64_t)(b & 0x7f) << shift;
+                if (!(b & 0x80))
+                        return 0;
+        }
+        return -1;
+}
+
+static uint64_t zigzag(int v)
+{
+        return ((uint64_t)v << 1) ^ (uint64_t)(int64_t)(v >> 31);
+}
+
+static int      unzigzag(uint64_t v)
+{
+        return (int)(v >> 1) ^ -(int)(v & 1);
+}
+
+static int      replay_start(void)
+{
+        run_budget = 0;
+        run_stop_on = 0;
+        last_button = 0;
+        next_hash = umac_get_time_us() + REPLAY_HASH_US;
+        free(hash_buf);
+        /* Zeroed, so padding in the state hashes the same every time */
+        hash_buf = calloc(1, umac_snapshot_size());
+        return hash_buf ? 0 : -1;
+}
+
+int     replay_record(const char *filename)
+{
+        replay_close();
+        rec_file = fopen(filename, "wb");
+        if (!rec_file) {
+                perror("Recording");
+                return -1;
+        }
+        fwrite(REPLAY_MAGIC, strlen(REPLAY_MAGIC), 1, rec_file);
+        return replay_start();
+}
+
+int     replay_open(const char *filename)
+{
+        char magic[8];
+
+        replay_close();
+        play_file = fopen(filename, "rb");
+        if (!play_file) {
+                perror("Replay");
+                return -1;
+        }
+        if (fread(magic, sizeof(magic), 1, play_file) != 1 ||
+            memcmp(magic, REPLAY_MAGIC, sizeof(magic))) {
+                fprintf(stderr, "%s: Not a recording\n", filename);
+                replay_close();
+                return -1;
+        }
+        return replay_start();
+}
+
+void    replay_close(void)
+{
+        if (rec_file)
+                fclose(rec_file);
+        if (play_file)
+                fclose(play_file);
+        rec_file = play_file = NULL;
+        free(hash_buf);
+        hash_buf = NULL;
+}
+
+/**********************************************************************/
+// Recording
+
+void    replay_kbd_event(uint8_t scancode, int down)
+{
+        if (rec_file) {
+                fputc(REC_KBD, rec_file);
+                fputc(scancode, rec_file);
+                fputc(!!down, rec_file);
+        }
+        umac_kbd_event(scancode, down);
+}
+
+void    replay_mouse(int deltax, int deltay, int button)
+{
+        /* Frontends tend to call this constantly, mostly with nothing
+         * to say, so skip those:
+         */
+        if (rec_file && (deltax || deltay || button != last_button)) {
+                fputc(REC_MOUSE, rec_file);
+                put_varint(zigzag(deltax));
+                put_varint(zigzag(deltay));
+                fputc(button, rec_file);
+                last_button = button;
+        }
+        umac_mouse(deltax, deltay, button);
+}
+
+void    replay_vsync_event(void)
+{
+        if (rec_file)
+                fputc(REC_VSYNC, rec_file);
+        umac_vsync_event();
+}
+
+void    replay_1hz_event(void)
+{
+        if (rec_file)
+                fputc(REC_1HZ, rec_file);
+        umac_1hz_event();
+}
+
+int     replay_run_until(uint64_t budget_us, unsigned int stop_on, uint64_t *elapsed_us)
+{
+        int r;
+
+        if (rec_file) {
+                if (budget_us == run_budget && stop_on == run_stop_on) {
+                        fputc(REC_RUN, rec_file);
+                } else {
+                        fputc(REC_RUN_PARAMS, rec_file);
+                        put_varint(budget_us);
+                        put_varint(stop_on);
+                        run_budget = budget_us;
+                        run_stop_on = stop_on;
+                }
+        }
+        r = umac_run_until(budget_us, stop_on, elapsed_us);
+
+        if (rec_file && umac_get_time_us() >= next_hash) {
+                uint64_t now = umac_get_time_us();
+                uint32_t h = state_hash();
+
+                fputc(REC_HASH, rec_file);
+                put_varint(now);
+                put_varint(h);
+                next_hash = now + REPLAY_HASH_US;
+        }
+        return r;
+}
+
+int     replay_loop(void)
+{
+        return replay_run_until(UMAC_EXECLOOP_QUANTUM, 0, NULL) == UMAC_RUN_DONE;
+}
+
+/**********************************************************************/
+// Playback
+
+static int      replay_check_hash(void)
+{
+        uint64_t t, h;
+
+        if (get_varint(&t) || get_varint(&h))
+                return REPLAY_BAD;
+        if (t != umac_get_time_us() || h != state_hash()) {
+                fprintf(stderr, "Replay: diverged at %lluus (recorded %lluus)\n",
+                        (unsigned long long)umac_get_time_us(),
+                        (unsigned long long)t);
+                return REPLAY_DIVERGED;
+        }
+        return REPLAY_OK;
+}
+
+int     replay_step(int *run_result)
+{
+        uint64_t a, b;
+        int c;
+
+        if (!play_file)
+                return REPLAY_END;
+
+        while ((c = fgetc(play_file)) != EOF) {
+                switch (c) {
+                case REC_RUN_PARAMS:
+                        if (get_varint(&a) || get_varint(&b))
+                                return REPLAY_BAD;
+                        run_budget = a;
+                        run_stop_on = b;
+                        /* Fall through */
+                case REC_RUN:
+                        *run_result = umac_run_until(run_budget, run_stop_on, NULL);
+                        /* Check the state straight away, if recorded here: */
+                        c = fgetc(play_file);
+                        if (c == REC_HASH)
+                                return replay_check_hash();
+                        if (c != EOF)
+                                ungetc(c, play_file);
+                        return REPLAY_OK;
+
+                case REC_KBD: {
+                        int code = fgetc(play_file);
+                        int down = fgetc(play_file);
+                        if (code == EOF || down == EOF)
+                                return REPLAY_BAD;
+                        umac_kbd_event(code, down);
+                } break;
+
+                case REC_MOUSE: {
+                        uint64_t dx, dy;
+                        if (get_varint(&dx) || get_varint(&dy) || (c = fgetc(play_file)) == EOF)
+                                return REPLAY_BAD;
+                        umac_mouse(unzigzag(dx), unzigzag(dy), c);
+                } break;
+
+                case REC_VSYNC:
+                        umac_vsync_event();
+                        break;
+
+                case REC_1HZ:
+                        umac_1hz_event();
+                        break;
+
+                case REC_HASH:
+                        if ((c = replay_check_hash()) != REPLAY_OK)
+                                return c;
+                        break;
+
+                default:
+                        return REPLAY_BAD;
+                }
+        }
+        return REPLAY_END;
+}
@@ -0,0 +1,247 @@
+/*
+ * Rewind buffer
+ *
+ * Each point holds the machine state (umac_snapshot_save()) and the
+ * RAM blocks that changed since the previous point.  Two full copies
+ * of RAM are kept: 'base', RAM as of the oldest point, and 'shadow',
+ * RAM as of the newest.  Capturing compares RAM against the shadow,
+ * but only for pages that have been written (see
+ * umac_ram_dirty_collect()), so memory and time go with the guest's
+ * write working set rather than RAM size times number of points.
+ * Restoring rebuilds RAM from base plus the deltas up to that point.
+ *
+ * Copyright 2024 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "umac.h"
+#include "machw.h"
+#include "rewind.h"
+
+#define REWIND_BLOCK            1024
+#define REWIND_NUM_BLOCKS       ((RAM_SIZE + REWIND_BLOCK - 1) / REWIND_BLOCK)
+
+typedef struct {
+        uint8_t *state;
+        uint64_t time_us;
+        unsigned int num_blocks;
+        uint32_t *blocks;       /* Block numbers... */
+        uint8_t *data;          /* ...and their contents */
+} rewind_point_t;
+
+static rewind_point_t *points = NULL;
+static unsigned int max_points = 0;
+static unsigned int first = 0;          /* Oldest */
+static unsigned int count = 0;
+static uint8_t *base = NULL;
+static uint8_t *shadow = NULL;
+static size_t state_size;
+static size_t mem_used = 0;
+
+static rewind_point_t *point(unsigned int i)
+{
+        return &points[(first + i) % max_points];
+}
+
+static void     point_clear(rewind_point_t *pt)
+{
+        mem_used -= (size_t)pt->num_blocks * REWIND_BLOCK;
+        free(pt->blocks);
+        free(pt->data);
+        pt->blocks = NULL;
+        pt->data = NULL;
+        pt->num_blocks = 0;
+}
+
+static void     point_apply(rewind_point_t *pt, uint8_t *ram)
+{
+        for (unsigned int i = 0; i < pt->num_blocks; i++) {
+                size_t off = (size_t)pt->blocks[i] * REWIND_BLOCK;
+                size_t len = (off + REWIND_BLOCK > RAM_SIZE) ? RAM_SIZE - off : REWIND_BLOCK;
+                memcpy(ram + off, pt->data + (size_t)i * REWIND_BLOCK, len);
+        }
+}
+
+int     rewind_init(unsigned int num)
+{
+        rewind_free();
+        if (num < 2)
+                return -1;
+
+        state_size = umac_snapshot_size();
+        points = calloc(num, sizeof(rewind_point_t));
+        base = malloc(RAM_SIZE);
+        shadow = malloc(RAM_SIZE);
+        if (!points || !base || !shadow) {
+                rewind_free();
+                return -1;
+        }
+        for (unsigned int i = 0; i < num; i++) {
+                points[i].state = malloc(state_size);
+                if (!points[i].state) {
+                        max_points = num;
+                        rewind_free();
+                        return -1;
+                }
+        }
+        max_points = num;
+        umac_opt_track_dirty(1);
+        return 0;
+}
+
+void    rewind_free(void)
+{
+        if (points) {
+                for (unsigned int i = 0; i < max_points; i++) {
+                        point_clear(&points[i]);
+                        free(points[i].state);
+                }
+                umac_opt_track_dirty(0);
+        }
+        free(points);
+        free(base);
+        free(shadow);
+        points = NULL;
+        base = shadow = NULL;
+        max_points = first = count = 0;
+        mem_used = 0;
+}
+
+int     rewind_capture(void)
+{
+        uint8_t dirty[UMAC_RAM_NUM_PAGES];
+        uint8_t *ram = ram_get_base();
+
+        if (!points)
+                return -1;
+        umac_ram_dirty_collect(dirty);
+
+        if (count == 0) {
+                memcpy(base, ram, RAM_SIZE);
+                memcpy(shadow, ram, RAM_SIZE);
+                umac_snapshot_save(points[first].state);
+                points[first].time_us = umac_get_time_us();
+                count = 1;
+                return 0;
+        }
+
+        /* Full: drop the oldest, and fold the next one's changes into
+         * base so that becomes the oldest:
+         */
+        if (count == max_points) {
+                first = (first + 1) % max_points;
+                count--;
+                point_apply(point(0), base);
+                point_clear(point(0));
+        }
+
+        rewind_point_t *pt = point(count);
+        uint32_t blocks[REWIND_NUM_BLOCKS];
+        unsigned int n = 0;
+
+        for (unsigned int b = 0; b < REWIND_NUM_BLOCKS; b++) {
+                size_t off = (size_t)b * REWIND_BLOCK;
+                size_t len = (off + REWIND_BLOCK > RAM_SIZE) ? RAM_SIZE - off : REWIND_BLOCK;
+
+                if (!dirty[off >> MEM_PAGE_SHIFT] ||
+                    !memcmp(ram + off, shadow + off, len))
+                        continue;
+                memcpy(shadow + off, ram + off, len);
+                blocks[n++] = b;
+        }
+
+        point_clear(pt);
+        if (n) {
+                pt->blocks = malloc(n * sizeof(uint32_t));
+                pt->data = malloc((size_t)n * REWIND_BLOCK);
+                if (!pt->blocks || !pt->data) {
+                        /* Shadow's now ahead of the points, so start
+                         * over from here:
+                         */
+                        for (unsigned int i = 0; i < max_points; i++)
+                                point_clear(&points[i]);
+                        count = 0;
+                        return rewind_capture();
+                }
+                memcpy(pt->blocks, blocks, n * sizeof(uint32_t));
+                for (unsigned int i = 0; i < n; i++) {
+                        size_t off = (size_t)blocks[i] * REWIND_BLOCK;
+                        size_t len = (off + REWIND_BLOCK > RAM_SIZE) ? RAM_SIZE - off : REWIND_BLOCK;
+                        memcpy(pt->data + (size_t)i * REWIND_BLOCK, ram + off, len);
+                }
+                pt->num_blocks = n;
+                mem_used += (size_t)n * REWIND_BLOCK;
+        }
+        umac_snapshot_save(pt->state);
+        pt->time_us = umac_get_time_us();
+        count++;
+        return 0;
+}
+
+unsigned int    rewind_num_points(void)
+{
+        return count;
+}
+
+size_t  rewind_mem_used(void)
+{
+        return mem_used;
+}
+
+int     rewind_restore(unsigned int back)
+{
+        uint8_t dirty[UMAC_RAM_NUM_PAGES];
+
+        if (back >= count)
+                return -1;
+
+        unsigned int target = count - 1 - back;
+        uint8_t *ram = ram_get_base();
+
+        memcpy(ram, base, RAM_SIZE);
+        for (unsigned int i = 1; i <= target; i++)
+                point_apply(point(i), ram);
+        memcpy(shadow, ram, RAM_SIZE);
+
+        for (unsigned int i = target + 1; i < count; i++)
+                point_clear(point(i));
+        count = target + 1;
+
+        if (umac_snapshot_load(point(target)->state))
+                return -1;
+        /* RAM matches the shadow again: */
+        umac_ram_dirty_collect(dirty);
+        return 0;
+}
+
+int     rewind_restore_to(uint64_t time_us)
+{
+        for (unsigned int back = 0; back < count; back++) {
+                if (point(count - 1 - back)->time_us <= time_us)
+                        return rewind_restore(back);
+        }
+        return -1;
+}
@@ -26,6 +26,7 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <string.h>
 
 #include "scc.h"
 
@@ -69,6 +70,17 @@ static void     scc_assess_irq(void);
 
 void    scc_init(struct scc_cb *cb)
 {
+        scc_reg_ptr = 0;
+        scc_mie = 0;
+        scc_read_acks = 0;
+        scc_status_hi = 0;
+        scc_ie[0] = scc_ie[1] = 0;
+        scc_irq_pending = 0;
+        scc_vec = 0;
+        scc_irq = 0;
+        scc_dcd_pins = 0;
+        scc_dcd_a_changed = 0;
+        scc_dcd_b_changed = 0;
         if (cb)
                 scc_callbacks = *cb;
 }
@@ -80,6 +92,8 @@ void    scc_set_dcd(int a, int b)
                 scc_dcd_a_changed = 1;
         if ((v ^ scc_dcd_pins) & 2)
                 scc_dcd_b_changed = 1;
+        if ((v ^ scc_dcd_pins) && scc_callbacks.status_change)
+                scc_callbacks.status_change();
         scc_dcd_pins = v;
 
         scc_assess_irq();
@@ -335,3 +349,59 @@ uint8_t scc_read(unsigned int address)
         return data;
 }
 
+
+////////////////////////////////////////////////////////////////////////////////
+// Per-instance state, see umac_select()
+
+struct scc_state {
+        uint8_t reg_ptr;
+        uint8_t mie;
+        uint8_t read_acks;
+        uint8_t status_hi;
+        uint8_t ie[2];
+        uint8_t irq_pending;
+        uint8_t vec;
+        uint8_t irq;
+        uint8_t dcd_pins;
+        uint8_t dcd_a_changed;
+        uint8_t dcd_b_changed;
+};
+
+size_t  scc_state_size(void)
+{
+        return sizeof(struct scc_state);
+}
+
+void    scc_state_save(void *state)
+{
+        struct scc_state *s = state;
+
+        s->reg_ptr = scc_reg_ptr;
+        s->mie = scc_mie;
+        s->read_acks = scc_read_acks;
+        s->status_hi = scc_status_hi;
+        memcpy(s->ie, scc_ie, sizeof(scc_ie));
+        s->irq_pending = scc_irq_pending;
+        s->vec = scc_vec;
+        s->irq = scc_irq;
+        s->dcd_pins = scc_dcd_pins;
+        s->dcd_a_changed = scc_dcd_a_changed;
+        s->dcd_b_changed = scc_dcd_b_changed;
+}
+
+void    scc_state_load(const void *state)
+{
+        const struct scc_state *s = state;
+
+        scc_reg_ptr = s->reg_ptr;
+        scc_mie = s->mie;
+        scc_read_acks = s->read_acks;
+        scc_status_hi = s->status_hi;
+        memcpy(scc_ie, s->ie, sizeof(scc_ie));
+        scc_irq_pending = s->irq_pending;
+        scc_vec = s->vec;
+        scc_irq = s->irq;
+        scc_dcd_pins = s->dcd_pins;
+        scc_dcd_a_changed = s->dcd_a_changed;
+        scc_dcd_b_changed = s->dcd_b_changed;
+}
@@ -0,0 +1,142 @@
+/* umac event scheduler
+ *
+ * Devices post events at a future emulated time, and the main loop
+ * runs the CPU up to the next deadline (rather than polling devices
+ * at fixed intervals).  There are only a handful of event sources, so
+ * this is a fixed table of slots plus a cached earliest deadline,
+ * rather than anything cleverer.
+ *
+ * Copyright 2024 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sched.h"
+
+static struct sched_cb callbacks;
+static sched_fn_t sched_fns[SCHED_NUM_EVTS];
+static uint64_t sched_times[SCHED_NUM_EVTS];
+static uint64_t sched_earliest = SCHED_NEVER;
+
+static void     sched_update_earliest(void)
+{
+        sched_earliest = SCHED_NEVER;
+        for (int i = 0; i < SCHED_NUM_EVTS; i++) {
+                if (sched_times[i] < sched_earliest)
+                        sched_earliest = sched_times[i];
+        }
+}
+
+void    sched_init(struct sched_cb *cb)
+{
+        if (cb)
+                callbacks = *cb;
+        for (int i = 0; i < SCHED_NUM_EVTS; i++)
+                sched_times[i] = SCHED_NEVER;
+        sched_earliest = SCHED_NEVER;
+}
+
+void    sched_register(int evt, sched_fn_t fn)
+{
+        sched_fns[evt] = fn;
+}
+
+uint64_t        sched_time(void)
+{
+        return callbacks.now();
+}
+
+void    sched_post_at(int evt, uint64_t time)
+{
+        if (sched_times[evt] == time)
+                return;
+        sched_times[evt] = time;
+        sched_update_earliest();
+        if (callbacks.deadline)
+                callbacks.deadline(time);
+}
+
+void    sched_post(int evt, uint64_t delay_us)
+{
+        sched_post_at(evt, callbacks.now() + delay_us);
+}
+
+void    sched_cancel(int evt)
+{
+        sched_times[evt] = SCHED_NEVER;
+        sched_update_earliest();
+}
+
+int     sched_pending(int evt)
+{
+        return sched_times[evt] != SCHED_NEVER;
+}
+
+uint64_t        sched_next(void)
+{
+        return sched_earliest;
+}
+
+void    sched_run(uint64_t time)
+{
+        while (sched_earliest <= time) {
+                for (int i = 0; i < SCHED_NUM_EVTS; i++) {
+                        if (sched_times[i] <= time) {
+                                /* Clear first, the handler might re-post */
+                                sched_times[i] = SCHED_NEVER;
+                                if (sched_fns[i])
+                                        sched_fns[i]();
+                        }
+                }
+                sched_update_earliest();
+        }
+}
+
+/* Per-instance state, see umac_select().  Handlers are the same for
+ * every instance, so only the deadlines are kept:
+ */
+struct sched_state {
+        uint64_t times[SCHED_NUM_EVTS];
+};
+
+size_t  sched_state_size(void)
+{
+        return sizeof(struct sched_state);
+}
+
+void    sched_state_save(void *state)
+{
+        struct sched_state *s = state;
+
+        memcpy(s->times, sched_times, sizeof(sched_times));
+}
+
+void    sched_state_load(const void *state)
+{
+        const struct sched_state *s = state;
+
+        memcpy(sched_times, s->times, sizeof(sched_times));
+        sched_update_earliest();
+}
@@ -0,0 +1,273 @@
+/*
+ * Snapshot files, for Unix-like hosts
+ *
+ * A file holds a header, the umac_snapshot_save() state, RAM (at an
+ * offset aligned for mmap(), so restoring needn't copy it), then the
+ * disc blocks that differ from the disc image:
+ *
+ *      struct snapfile_hdr
+ *      state[state_size]
+ *      (padding)
+ *      RAM[ram_size]           at ram_off
+ *      { uint32_t block; uint8_t data[SNAPFILE_BLOCK]; } x num_dirty
+ *
+ * Copyright 2024 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "umac.h"
+#include "machw.h"
+#include "snapshot.h"
+
+#define SNAPFILE_MAGIC          "umacsnap"
+#define SNAPFILE_VERSION        1
+#define SNAPFILE_ALIGN          65536   /* Any host page size */
+#define SNAPFILE_BLOCK          512
+
+struct snapfile_hdr {
+        char magic[8];
+        uint32_t version;
+        uint32_t state_size;
+        uint64_t ram_off;
+        uint64_t ram_size;
+        uint64_t disc_size;
+        uint64_t dirty_off;
+        uint32_t num_dirty;
+        uint32_t pad;
+};
+
+int     snapshot_write(const char *filename, disc_descr_t *disc, int disc_fd)
+{
+        struct snapfile_hdr h = {0};
+        size_t state_size = umac_snapshot_size();
+        uint8_t *state = malloc(state_size);
+        FILE *f = NULL;
+        int r = -1;
+
+        if (!state)
+                return -1;
+        umac_snapshot_save(state);
+
+        f = fopen(filename, "wb");
+        if (!f) {
+                perror("Snapshot");
+                goto out;
+        }
+
+        memcpy(h.magic, SNAPFILE_MAGIC, sizeof(h.magic));
+        h.version = SNAPFILE_VERSION;
+        h.state_size = state_size;
+        h.ram_off = (sizeof(h) + state_size + SNAPFILE_ALIGN - 1) & ~(uint64_t)(SNAPFILE_ALIGN - 1);
+        h.ram_size = RAM_SIZE;
+        h.dirty_off = h.ram_off + RAM_SIZE;
+
+        if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+            fwrite(state, state_size, 1, f) != 1 ||
+            fseek(f, h.ram_off, SEEK_SET) ||
+            fwrite(ram_get_base(), RAM_SIZE, 1, f) != 1)
+                goto write_err;
+
+        /* Compare the disc with its image, saving blocks that differ: */
+        if (disc && disc->base && disc_fd >= 0) {
+                uint8_t buf[SNAPFILE_BLOCK];
+
+                h.disc_size = disc->size;
+                for (uint32_t b = 0; b < disc->size / SNAPFILE_BLOCK; b++) {
+                        uint8_t *d = disc->base + (size_t)b * SNAPFILE_BLOCK;
+
+                        if (pread(disc_fd, buf, SNAPFILE_BLOCK, (off_t)b * SNAPFILE_BLOCK) == SNAPFILE_BLOCK &&
+                            !memcmp(buf, d, SNAPFILE_BLOCK))
+                                continue;
+                        if (fwrite(&b, sizeof(b), 1, f) != 1 ||
+                            fwrite(d, SNAPFILE_BLOCK, 1, f) != 1)
+                                goto write_err;
+                        h.num_dirty++;
+                }
+        }
+
+        /* Now the header's complete: */
+        if (fseek(f, 0, SEEK_SET) || fwrite(&h, sizeof(h), 1, f) != 1)
+                goto write_err;
+        r = 0;
+        goto out;
+
+write_err:
+        perror("Snapshot write");
+out:
+        if (f && fclose(f))
+                r = -1;
+        free(state);
+        return r;
+}
+
+/* Open filename and check it's a snapshot usable with disc, reading
+ * its header and state.  Returns the fd, or -1.
+ */
+static int      snapfile_open(const char *filename, disc_descr_t *disc,
+                              struct snapfile_hdr *h, uint8_t **state)
+{
+        int fd = open(filename, O_RDONLY);
+        struct stat st;
+
+        *state = NULL;
+        if (fd < 0) {
+                perror("Snapshot");
+                return -1;
+        }
+        if (pread(fd, h, sizeof(*h), 0) != sizeof(*h) ||
+            memcmp(h->magic, SNAPFILE_MAGIC, sizeof(h->magic)) ||
+            h->version != SNAPFILE_VERSION) {
+                fprintf(stderr, "%s: Not a snapshot\n", filename);
+                goto fail;
+        }
+        if (h->ram_size != RAM_SIZE || h->state_size != umac_snapshot_size()) {
+                fprintf(stderr, "%s: Snapshot doesn't match this build\n", filename);
+                goto fail;
+        }
+        if (h->num_dirty && (!disc || !disc->base || disc->size != h->disc_size)) {
+                fprintf(stderr, "%s: Snapshot needs the disc it was taken with\n", filename);
+                goto fail;
+        }
+        /* Check the disc blocks up front, so a bad file is rejected
+         * before anything's been written into RAM or the disc:
+         */
+        if (fstat(fd, &st) ||
+            h->dirty_off + (uint64_t)h->num_dirty * (sizeof(uint32_t) + SNAPFILE_BLOCK) > (uint64_t)st.st_size) {
+                fprintf(stderr, "%s: Snapshot is truncated\n", filename);
+                goto fail;
+        }
+        for (uint32_t i = 0; i < h->num_dirty; i++) {
+                off_t off = h->dirty_off + (off_t)i * (sizeof(uint32_t) + SNAPFILE_BLOCK);
+                uint32_t b;
+
+                if (pread(fd, &b, sizeof(b), off) != sizeof(b) ||
+                    ((uint64_t)b + 1) * SNAPFILE_BLOCK > disc->size) {
+                        fprintf(stderr, "%s: Bad disc block %d\n", filename, i);
+                        goto fail;
+                }
+        }
+
+        *state = malloc(h->state_size);
+        if (!*state || pread(fd, *state, h->state_size, sizeof(*h)) != h->state_size ||
+            umac_snapshot_check(*state))
+                goto fail;
+        return fd;
+
+fail:
+        free(*state);
+        *state = NULL;
+        close(fd);
+        return -1;
+}
+
+/* Write the snapshot's modified disc blocks into disc->base (their
+ * numbers have already been checked by snapfile_open())
+ */
+static int      snapfile_disc_blocks(const char *filename, int fd,
+                                     const struct snapfile_hdr *h, disc_descr_t *disc)
+{
+        for (uint32_t i = 0; i < h->num_dirty; i++) {
+                off_t off = h->dirty_off + (off_t)i * (sizeof(uint32_t) + SNAPFILE_BLOCK);
+                uint32_t b;
+
+                if (pread(fd, &b, sizeof(b), off) != sizeof(b) ||
+                    ((uint64_t)b + 1) * SNAPFILE_BLOCK > disc->size ||
+                    pread(fd, disc->base + (size_t)b * SNAPFILE_BLOCK, SNAPFILE_BLOCK,
+                          off + sizeof(b)) != SNAPFILE_BLOCK) {
+                        fprintf(stderr, "%s: Bad disc block %d\n", filename, i);
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+void    *snapshot_restore(const char *filename, void *rom_base,
+                          disc_descr_t discs[DISC_NUM_DRIVES])
+{
+        struct snapfile_hdr h;
+        uint8_t *state;
+        void *ram = MAP_FAILED;
+        int fd = snapfile_open(filename, &discs[0], &h, &state);
+
+        if (fd < 0)
+                return NULL;
+
+        /* Private, so the guest's writes don't go back to the file: */
+        ram = mmap(0, RAM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, h.ram_off);
+        if (ram == MAP_FAILED) {
+                perror("Snapshot RAM mmap");
+                goto fail;
+        }
+
+        if (snapfile_disc_blocks(filename, fd, &h, &discs[0]) ||
+            umac_snapshot_restore(state, ram, rom_base, discs))
+                goto fail;
+
+        free(state);
+        close(fd);
+        return ram;
+
+fail:
+        if (ram != MAP_FAILED)
+                munmap(ram, RAM_SIZE);
+        free(state);
+        close(fd);
+        return NULL;
+}
+
+int     snapshot_load(const char *filename, disc_descr_t *disc, int disc_fd)
+{
+        struct snapfile_hdr h;
+        uint8_t *state;
+        int r = -1;
+        int fd = snapfile_open(filename, disc, &h, &state);
+
+        if (fd < 0)
+                return -1;
+
+        if (pread(fd, ram_get_base(), RAM_SIZE, h.ram_off) != RAM_SIZE) {
+                perror("Snapshot RAM");
+                goto out;
+        }
+        /* Disc back to the image, plus the snapshot's changes: */
+        if (disc && disc->base && disc_fd >= 0 &&
+            pread(disc_fd, disc->base, disc->size, 0) != (ssize_t)disc->size) {
+                perror("Snapshot disc");
+                goto out;
+        }
+        if (snapfile_disc_blocks(filename, fd, &h, disc) == 0 &&
+            umac_snapshot_load(state) == 0)
+                r = 0;
+out:
+        free(state);
+        close(fd);
+        return r;
+}
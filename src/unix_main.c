@@ -28,6 +28,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <sys/mman.h>
@@ -41,6 +42,9 @@
 #include "umac.h"
 #include "machw.h"
 #include "disc.h"
+#include "snapshot.h"
+#include "rewind.h"
+#include "replay.h"
 
 #include "keymap_sdl.h"
 
@@ -49,9 +53,21 @@ static void     print_help(char *n)
         printf("Syntax: %s <options>\n"
                "\t-r <rom path>\t\tDefault 'rom.bin'\n"
                "\t-W <rom dump path>\tDump ROM after patching\n"
+               "\t-R <snapshot path>\tResume from snapshot (same ROM/disc as saved)\n"
+               "\t-S <snapshot path>\tSave snapshot at exit\n"
+               "\t-k <frames>\t\tKeep a rewind point every <frames> frames (F12 steps back)\n"
+               "\t-K <points>\t\tNumber of rewind points kept (default 30, min 2)\n"
+               "\t-g <seconds>\t\tWatchdog: on a System Error, or no VBL progress for <seconds>,\n"
+               "\t\t\t\trewind (-k) or reload the -R snapshot, else quit\n"
+               "\t-E <recording path>\tRecord input, for replay with -e\n"
+               "\t-e <recording path>\tReplay recorded input (same ROM/disc/options as recorded)\n"
                "\t-d <disc path>\n"
                "\t-w\t\t\tEnable persistent disc writes (default R/O)\n"
-               "\t-i\t\t\tDisassembled instruction trace\n", n);
+               "\t-i\t\t\tDisassembled instruction trace\n"
+               "\t-p\t\t\tProfile guest execution (dumped at exit)\n"
+               "\t-P <ops path>\t\tProfile, and write opcode histogram at exit\n"
+               "\t-s <speed>\t\tPace to <speed> x real Mac speed (default unthrottled)\n"
+               "\t-t\t\t\tGenerate VBL/1Hz from emulated time, not wallclock\n", n);
 }
 
 #define DISP_SCALE      2
@@ -66,8 +82,8 @@ static void     copy_fb(uint32_t *fb_out, uint8_t *fb_in)
         // Output L-R, big-endian shorts, with bits in MSB-LSB order:
         for (int y = 0; y < DISP_HEIGHT; y++) {
                 for (int x = 0; x < DISP_WIDTH; x += 16) {
-                        uint8_t plo = fb_in[x/8 + (y * DISP_WIDTH/8) + 0];
-                        uint8_t phi = fb_in[x/8 + (y * DISP_WIDTH/8) + 1];
+                        uint8_t plo = fb_in[MEM_BYTE_ADDR(x/8 + (y * DISP_WIDTH/8) + 0)];
+                        uint8_t phi = fb_in[MEM_BYTE_ADDR(x/8 + (y * DISP_WIDTH/8) + 1)];
                         for (int i = 0; i < 8; i++) {
                                 *fb_out++ = (plo & (0x80 >> i)) ? 0 : 0xffffffff;
                         }
@@ -78,6 +94,14 @@ static void     copy_fb(uint32_t *fb_out, uint8_t *fb_in)
         }
 }
 
+static uint64_t get_usec(void)
+{
+        struct timeval tv_now;
+
+        gettimeofday(&tv_now, NULL);
+        return (tv_now.tv_sec * 1000000) + tv_now.tv_usec;
+}
+
 /**********************************************************************/
 
 /* The emulator core expects to be given ROM and RAM pointers,
@@ -96,15 +120,27 @@ int     main(int argc, char *argv[])
         char *rom_dump_filename = NULL;
         char *ram_filename = "ram.bin";
         char *disc_filename = NULL;
+        char *ops_filename = NULL;
+        char *snap_in_filename = NULL;
+        char *snap_out_filename = NULL;
         int ofd;
+        int disc_fd = -1;
         int ch;
         int opt_disassemble = 0;
+        int opt_profile = 0;
         int opt_write = 0;
+        double opt_speed = 0;
+        int opt_internal_timing = 0;
+        int opt_rewind_frames = 0;
+        int opt_rewind_points = 30;
+        int opt_watchdog = 0;
+        char *rec_filename = NULL;
+        char *replay_filename = NULL;
 
         ////////////////////////////////////////////////////////////////////////
         // Args
 
-        while ((ch = getopt(argc, argv, "r:d:W:ihw")) != -1) {
+        while ((ch = getopt(argc, argv, "r:d:W:P:R:S:k:K:g:E:e:s:ihwpt")) != -1) {
                 switch (ch) {
                 case 'r':
                         rom_filename = strdup(optarg);
@@ -114,6 +150,15 @@ int     main(int argc, char *argv[])
                         opt_disassemble = 1;
                         break;
 
+                case 'p':
+                        opt_profile = 1;
+                        break;
+
+                case 'P':
+                        opt_profile = 1;
+                        ops_filename = strdup(optarg);
+                        break;
+
                 case 'd':
                         disc_filename = strdup(optarg);
                         break;
@@ -122,16 +167,66 @@ int     main(int argc, char *argv[])
                         opt_write = 1;
                         break;
 
+                case 's':
+                        opt_speed = atof(optarg);
+                        break;
+
+                case 't':
+                        opt_internal_timing = 1;
+                        break;
+
                 case 'W':
                         rom_dump_filename = strdup(optarg);
                         break;
 
+                case 'R':
+                        snap_in_filename = strdup(optarg);
+                        break;
+
+                case 'S':
+                        snap_out_filename = strdup(optarg);
+                        break;
+
+                case 'k':
+                        opt_rewind_frames = atoi(optarg);
+                        break;
+
+                case 'K':
+                        opt_rewind_points = atoi(optarg);
+                        if (opt_rewind_points < 2)
+                                opt_rewind_points = 2;  /* See rewind_init() */
+                        break;
+
+                case 'g':
+                        opt_watchdog = atoi(optarg);
+                        break;
+
+                case 'E':
+                        rec_filename = strdup(optarg);
+                        break;
+
+                case 'e':
+                        replay_filename = strdup(optarg);
+                        break;
+
                 case 'h':
                 default:
                         print_help(argv[0]);
                         return 1;
                 }
         }
+        /* Snapshots hold the disc as changes from its image, and with
+         * -w the image itself changes:
+         */
+        if (opt_write && (snap_in_filename || snap_out_filename)) {
+                printf("Can't use snapshots with a writable disc\n");
+                return 1;
+        }
+        /* Rewinding isn't something a recording can express: */
+        if ((rec_filename || replay_filename) && opt_rewind_frames > 0) {
+                printf("Can't rewind while recording or replaying\n");
+                return 1;
+        }
 
         ////////////////////////////////////////////////////////////////////////
         // Load memories/discs
@@ -175,22 +270,26 @@ int     main(int argc, char *argv[])
                 close(rfd);
         }
 
-        /* Set up RAM, shared file map: */
-        ofd = open(ram_filename, O_CREAT | O_TRUNC | O_RDWR, 0644);
-        if (ofd < 0) {
-                perror("RAM");
-                return 1;
-        }
-        if (ftruncate(ofd, RAM_SIZE)) {
-                perror("RAM ftruncate");
-                return 1;
-        }
-        ram_base = mmap(0, RAM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ofd, 0);
-        if (ram_base == MAP_FAILED) {
-                perror("RAM mmap");
-                return 1;
+        /* Set up RAM, shared file map (unless it comes from a
+         * snapshot, below):
+         */
+        if (!snap_in_filename) {
+                ofd = open(ram_filename, O_CREAT | O_TRUNC | O_RDWR, 0644);
+                if (ofd < 0) {
+                        perror("RAM");
+                        return 1;
+                }
+                if (ftruncate(ofd, RAM_SIZE)) {
+                        perror("RAM ftruncate");
+                        return 1;
+                }
+                ram_base = mmap(0, RAM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ofd, 0);
+                if (ram_base == MAP_FAILED) {
+                        perror("RAM mmap");
+                        return 1;
+                }
+                printf("RAM mapped at %p\n", (void *)ram_base);
         }
-        printf("RAM mapped at %p\n", (void *)ram_base);
 
         disc_descr_t discs[DISC_NUM_DRIVES] = {0};
 
@@ -224,6 +323,7 @@ int     main(int argc, char *argv[])
                 discs[0].base = disc_base;
                 discs[0].read_only = 0;         /* See above */
                 discs[0].size = disc_size;
+                disc_fd = ofd;                  /* For snapshots */
         }
 
         ////////////////////////////////////////////////////////////////////////
@@ -267,8 +367,28 @@ int     main(int argc, char *argv[])
         ////////////////////////////////////////////////////////////////////////
         // Emulator init
 
-        umac_init(ram_base, rom_base, discs);
+        if (snap_in_filename) {
+                uint64_t t = get_usec();
+                ram_base = snapshot_restore(snap_in_filename, rom_base, discs);
+                if (!ram_base)
+                        return 1;
+                printf("Resumed from '%s' in %lldus\n", snap_in_filename,
+                       (long long)(get_usec() - t));
+        } else {
+                umac_init(ram_base, rom_base, discs);
+        }
         umac_opt_disassemble(opt_disassemble);
+        umac_opt_profile(opt_profile);
+        umac_opt_internal_timing(opt_internal_timing);
+        umac_opt_watchdog(opt_watchdog);
+        if (opt_rewind_frames > 0 && rewind_init(opt_rewind_points)) {
+                printf("Can't allocate rewind buffer\n");
+                return 1;
+        }
+        if (rec_filename && replay_record(rec_filename))
+                return 1;
+        if (replay_filename && replay_open(replay_filename))
+                return 1;
 
         ////////////////////////////////////////////////////////////////////////
         // Main loop
@@ -277,13 +397,29 @@ int     main(int argc, char *argv[])
         int mouse_button = 0;
         uint64_t last_vsync = 0;
         uint64_t last_1hz = 0;
+        int rewind_frames = 0;
+        int replaying = (replay_filename != NULL);
+        uint64_t pace_usec = get_usec();
+        uint64_t pace_emu_usec = umac_get_time_us();
         do {
-                struct timeval tv_now;
                 SDL_Event event;
                 int mousex = 0;
                 int mousey = 0;
+                int got_event;
+
+                if (umac_idle_until() == UMAC_IDLE_FOREVER && !replaying) {
+                        /* The Mac's waiting for input or the next
+                         * vsync, so sleep until one of those:
+                         */
+                        uint64_t now_usec = get_usec();
+                        uint64_t next_vsync = last_vsync + 16667;
+                        int ms = (next_vsync > now_usec) ? (next_vsync - now_usec) / 1000 : 0;
+                        got_event = SDL_WaitEventTimeout(&event, ms);
+                } else {
+                        got_event = SDL_PollEvent(&event);
+                }
 
-                if (SDL_PollEvent(&event)) {
+                if (got_event) {
                         switch (event.type) {
                         case SDL_QUIT:
                                 done = 1;
@@ -291,11 +427,23 @@ int     main(int argc, char *argv[])
 
                         case SDL_KEYDOWN:
                         case SDL_KEYUP: {
+                                if (event.key.keysym.scancode == SDL_SCANCODE_F12) {
+                                        /* Back to the previous point (the
+                                         * latest is a moment ago): */
+                                        if (event.type == SDL_KEYDOWN && opt_rewind_frames > 0 &&
+                                            rewind_restore(rewind_num_points() > 1 ? 1 : 0) == 0)
+                                                printf("Rewound to %.2fs (%d points left, %zuKB)\n",
+                                                       umac_get_time_us() / 1000000.0,
+                                                       rewind_num_points(),
+                                                       rewind_mem_used() / 1024);
+                                        rewind_frames = 0;
+                                        break;
+                                }
                                 int c = SDLScan2MacKeyCode(event.key.keysym.scancode);
                                 c = (c << 1) | 1;
                                 printf("Key 0x%x -> 0x%x\n", event.key.keysym.scancode, c);
-                                if (c != MKC_None)
-                                        umac_kbd_event(c, (event.type == SDL_KEYDOWN));
+                                if (c != MKC_None && !replaying)
+                                        replay_kbd_event(c, (event.type == SDL_KEYDOWN));
                         } break;
 
                         case SDL_MOUSEMOTION:
@@ -313,18 +461,89 @@ int     main(int argc, char *argv[])
                         }
                 }
 
-                umac_mouse(mousex, mousey, mouse_button);
-
-                done |= umac_loop();
+                int run_done = 0;
+                if (replaying) {
+                        /* Input comes from the recording instead: */
+                        int run = UMAC_RUN_BUDGET;
+                        int r = replay_step(&run);
+
+                        run_done = (run == UMAC_RUN_DONE);
+                        if (r == REPLAY_END) {
+                                printf("Replay finished at %.2fs, input is live\n",
+                                       umac_get_time_us() / 1000000.0);
+                                replay_close();
+                                replaying = 0;
+                        } else if (r != REPLAY_OK) {
+                                printf("Replay %s at %.2fs\n",
+                                       (r == REPLAY_DIVERGED) ? "diverged" : "is corrupt",
+                                       umac_get_time_us() / 1000000.0);
+                                done = 1;
+                        }
+                } else {
+                        replay_mouse(mousex, mousey, mouse_button);
+                        run_done = replay_loop();
+                }
 
-                gettimeofday(&tv_now, NULL);
-                uint64_t now_usec = (tv_now.tv_sec * 1000000) + tv_now.tv_usec;
+                umac_watchdog_t wd;
+                if (umac_watchdog_get(&wd) != UMAC_WD_NONE && opt_watchdog > 0) {
+                        char buf[200];
+
+                        umac_watchdog_describe(&wd, buf, sizeof(buf));
+                        printf("Watchdog: %s at %.2fs\n", buf, wd.time_us / 1000000.0);
+                        for (int i = 0; i < 8; i++)
+                                printf("  D%d: %08x  A%d: %08x\n", i, wd.d[i], i, wd.a[i]);
+                        printf("  SR: %04x\n", wd.sr);
+
+                        /* Back to a known-good state, unless that would
+                         * break a recording:
+                         */
+                        int can_restore = !rec_filename && !replay_filename;
+                        run_done = 1;
+                        if (can_restore && opt_rewind_frames > 0 &&
+                            rewind_restore_to(wd.since_us) == 0) {
+                                printf("Rewound to %.2fs\n", umac_get_time_us() / 1000000.0);
+                                rewind_frames = 0;
+                                run_done = 0;
+                        } else if (can_restore && snap_in_filename &&
+                                   snapshot_load(snap_in_filename, &discs[0], disc_fd) == 0) {
+                                printf("Restarted from '%s'\n", snap_in_filename);
+                                /* RAM was rewritten behind its back: */
+                                if (opt_rewind_frames > 0)
+                                        rewind_init(opt_rewind_points);
+                                run_done = 0;
+                        }
+                }
+                done |= run_done;
+
+                uint64_t now_usec = get_usec();
+
+                if (opt_speed > 0) {
+                        /* Hold emulated time to opt_speed x wallclock.
+                         * If we fall way behind (host too slow, or the
+                         * window was dragged), don't try to catch up.
+                         */
+                        uint64_t emu_usec = umac_get_time_us() - pace_emu_usec;
+                        uint64_t target = pace_usec + (uint64_t)(emu_usec / opt_speed);
+                        if (target > now_usec) {
+                                usleep(target - now_usec);
+                                now_usec = get_usec();
+                        } else if ((now_usec - target) > 100000) {
+                                pace_usec = now_usec;
+                                pace_emu_usec = umac_get_time_us();
+                        }
+                }
 
                 /* Passage of time: */
                 if ((now_usec - last_vsync) >= 16667) {
-                        umac_vsync_event();
+                        if (!opt_internal_timing && !replaying)
+                                replay_vsync_event();
                         last_vsync = now_usec;
 
+                        if (opt_rewind_frames > 0 && ++rewind_frames >= opt_rewind_frames) {
+                                rewind_capture();
+                                rewind_frames = 0;
+                        }
+
                         /* Cheapo framerate limiting: */
                         copy_fb(framebuffer, ram_get_base() + umac_get_fb_offset());
                         SDL_UpdateTexture(texture, NULL, framebuffer,
@@ -333,11 +552,29 @@ int     main(int argc, char *argv[])
                         SDL_RenderCopy(renderer, texture, NULL, NULL);
                         SDL_RenderPresent(renderer);
                 }
-                if ((now_usec - last_1hz) >= 1000000) {
-                        umac_1hz_event();
+                if ((now_usec - last_1hz) >= 1000000 && !opt_internal_timing && !replaying) {
+                        replay_1hz_event();
                         last_1hz = now_usec;
                 }
         } while (!done);
+        replay_close();
+
+        if (snap_out_filename) {
+                if (snapshot_write(snap_out_filename, &discs[0], disc_fd) == 0)
+                        printf("Saved snapshot to '%s'\n", snap_out_filename);
+        }
+
+        if (opt_profile)
+                umac_profile_dump(stdout);
+        if (ops_filename) {
+                FILE *f = fopen(ops_filename, "w");
+                if (f) {
+                        umac_profile_dump_ops(f);
+                        fclose(f);
+                } else {
+                        perror("Opcode histogram");
+                }
+        }
 
         return 0;
 }
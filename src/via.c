@@ -28,8 +28,10 @@
 
 #include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "via.h"
+#include "sched.h"
 
 #ifdef DEBUG
 #define VDBG(...)       printf(__VA_ARGS__)
@@ -51,11 +53,15 @@
 #define VIA_T2CH        9
 #define VIA_SR          10
 #define VIA_ACR         11
+#define  VIA_ACR_T2_PULSES      0x20
+#define  VIA_ACR_T1_FREERUN     0x40
 #define VIA_PCR         12
 #define VIA_IFR         13
 #define  VIA_IRQ_CA     0x01
 #define  VIA_IRQ_CB     0x02
 #define  VIA_IRQ_SR     0x04
+#define  VIA_IRQ_T2     0x20
+#define  VIA_IRQ_T1     0x40
 #define VIA_IER         14
 #define VIA_RA_ALT      15 // No-handshake version
 
@@ -83,14 +89,37 @@ static struct via_cb via_callbacks;
 static int irq_status = 0;
 static uint8_t irq_active = 0;
 static uint8_t irq_enable = 0;
+static uint8_t irq_last_active = 0;
+static int sr_tx_pending = -1;
+
+/* Timer state, see "Timers" below */
+static uint64_t t1_load_time = 0;       /* In dots */
+static uint16_t t1_load_val = 0;
+static int t1_armed = 0;                /* IRQ to come */
+static uint64_t t2_load_time = 0;
+static uint16_t t2_load_val = 0;
+static int t2_armed = 0;
+
+static void via_timer_event(void);
+static void via_ifr_set(uint8_t flags);
 
 void    via_init(struct via_cb *cb)
 {
         for (int i = 0; i < 16; i++)
                 via_regs[i] = 0;
         via_regs[VIA_RA] = 0x10; // Overlay, FIXME
+        irq_status = 0;
+        irq_active = 0;
+        irq_enable = 0;
+        irq_last_active = 0;
+        sr_tx_pending = -1;
+        t1_load_time = t2_load_time = 0;
+        t1_load_val = t2_load_val = 0;
+        t1_armed = t2_armed = 0;
         if (cb)
                 via_callbacks = *cb;
+        sched_register(SCHED_EVT_VIA_T1, via_timer_event);
+        sched_register(SCHED_EVT_VIA_T2, via_timer_event);
 }
 
 static void via_update_rega(uint8_t data)
@@ -105,8 +134,6 @@ static void via_update_regb(uint8_t data)
                 via_callbacks.rb_change(data);
 }
 
-static int sr_tx_pending = -1;
-
 static void via_update_sr(uint8_t data)
 {
         /* Mac assumption: SR active when ACR SR control selects
@@ -126,7 +153,7 @@ static void via_update_sr(uint8_t data)
                  * reflected back too soon.
                  */
                 sr_tx_pending = data;
-                irq_active |= VIA_IRQ_SR;
+                via_ifr_set(VIA_IRQ_SR);
         } else if ((via_regs[VIA_ACR] & 0x1c) == 0x18) {
                 /* Mac sends a byte of zeroes fuelled by phi2, as a
                  * method to pull KbdData low (to get the kbd's
@@ -163,16 +190,25 @@ static void via_sr_done(void)
 // 1 CA2: Vertical blanking interrupt
 // 0 CA1: One-second interrupt
 
+/* Flag events in IFR.  The host hears about them even if they're
+ * masked, as the guest might be polling IFR:
+ */
+static void via_ifr_set(uint8_t flags)
+{
+        irq_active |= flags;
+        if (via_callbacks.ifr_set)
+                via_callbacks.ifr_set(flags);
+}
+
 static void via_assess_irq(void)
 {
         int irq = 0;
-        static uint8_t last_active = 0;
         uint8_t active = irq_enable & irq_active & 0x7f;
         irq = active != 0;
 
-        if (active != last_active) {
+        if (active != irq_last_active) {
                 VDBG("[VIA: IRQ state now %02x]\n", active);
-                last_active = active;
+                irq_last_active = active;
         }
         if (irq != irq_status) {
                 via_callbacks.irq_set(irq);
@@ -180,6 +216,140 @@ static void via_assess_irq(void)
         }
 }
 
+/* Timers
+ *
+ * The VIA's clocked from E, 783.36kHz, which is the 15.6672MHz video
+ * dot clock / 20.  Time here is counted in dot clocks, which makes
+ * T2's pulse-counting mode (counting hblank pulses on PB6, one per
+ * 704-dot scanline) exact as well.
+ *
+ * Rather than ticking the counters along, remember when each was
+ * loaded (and with what), and work out the current count on demand.
+ * The time at which each IRQ is due is posted to the scheduler, so
+ * the timers cost nothing in between.
+ */
+#define VIA_DOTS_PER_US_X10000  156672
+#define VIA_DOTS_PER_TICK       20
+#define VIA_DOTS_PER_LINE       704
+
+static uint64_t via_now(void)
+{
+        return sched_time() * VIA_DOTS_PER_US_X10000 / 10000;
+}
+
+static uint16_t via_t1_latch(void)
+{
+        return via_regs[VIA_T1LL] | (via_regs[VIA_T1LH] << 8);
+}
+
+static uint64_t via_t1_expiry(void)
+{
+        return t1_load_time + ((uint64_t)t1_load_val + 1) * VIA_DOTS_PER_TICK;
+}
+
+static uint64_t via_t2_expiry(void)
+{
+        if (via_regs[VIA_ACR] & VIA_ACR_T2_PULSES) {
+                uint64_t n = t2_load_val ? t2_load_val : 0x10000;
+                return (t2_load_time / VIA_DOTS_PER_LINE + n) * VIA_DOTS_PER_LINE;
+        }
+        return t2_load_time + ((uint64_t)t2_load_val + 1) * VIA_DOTS_PER_TICK;
+}
+
+static uint16_t via_t1_count(uint64_t now)
+{
+        /* The tick spent at 0xffff before a free-running reload: */
+        if (now < t1_load_time)
+                return 0xffff;
+        return t1_load_val - (now - t1_load_time) / VIA_DOTS_PER_TICK;
+}
+
+static uint16_t via_t2_count(uint64_t now)
+{
+        if (via_regs[VIA_ACR] & VIA_ACR_T2_PULSES)
+                return t2_load_val - (now / VIA_DOTS_PER_LINE -
+                                      t2_load_time / VIA_DOTS_PER_LINE);
+        return t2_load_val - (now - t2_load_time) / VIA_DOTS_PER_TICK;
+}
+
+/* Raise IRQs for timers that have expired by now.  A one-shot timer
+ * then keeps counting down (without further IRQs), and a free-running
+ * T1 reloads from the latches, giving a period of latch+2 ticks.
+ */
+static void via_timers_update(uint64_t now)
+{
+        if (t1_armed && now >= via_t1_expiry()) {
+                via_ifr_set(VIA_IRQ_T1);
+                if (via_regs[VIA_ACR] & VIA_ACR_T1_FREERUN) {
+                        uint64_t exp = via_t1_expiry();
+                        uint64_t period = ((uint64_t)via_t1_latch() + 2) * VIA_DOTS_PER_TICK;
+                        /* If the IRQ's masked we might not have been
+                         * watching, so skip any missed periods:
+                         */
+                        t1_load_time = exp + ((now - exp) / period) * period +
+                                VIA_DOTS_PER_TICK;
+                        t1_load_val = via_t1_latch();
+                } else {
+                        t1_armed = 0;
+                }
+        }
+        if (t2_armed && now >= via_t2_expiry()) {
+                via_ifr_set(VIA_IRQ_T2);
+                t2_armed = 0;
+        }
+}
+
+static uint64_t via_dots_to_us(uint64_t dots)
+{
+        return (dots * 10000 + VIA_DOTS_PER_US_X10000 - 1) / VIA_DOTS_PER_US_X10000;
+}
+
+/* Post the next timer IRQs to the scheduler.  No events are needed
+ * for a timer whose IRQ is masked and already flagged in IFR: nothing
+ * can change until the IFR's cleared, which reschedules.
+ */
+static void via_timers_schedule(void)
+{
+        uint8_t quiet = irq_active & ~irq_enable;
+
+        if (t1_armed && !(quiet & VIA_IRQ_T1))
+                sched_post_at(SCHED_EVT_VIA_T1, via_dots_to_us(via_t1_expiry()));
+        else
+                sched_cancel(SCHED_EVT_VIA_T1);
+
+        if (t2_armed && !(quiet & VIA_IRQ_T2))
+                sched_post_at(SCHED_EVT_VIA_T2, via_dots_to_us(via_t2_expiry()));
+        else
+                sched_cancel(SCHED_EVT_VIA_T2);
+}
+
+/* The ACR's changing timer modes: restart the affected counts from
+ * where they are now, in the new mode.
+ */
+static void via_timers_rebase(uint64_t now, uint8_t new_acr)
+{
+        uint8_t changed = via_regs[VIA_ACR] ^ new_acr;
+
+        if ((changed & VIA_ACR_T1_FREERUN) && now >= t1_load_time) {
+                t1_load_val = via_t1_count(now);
+                t1_load_time = now - (now - t1_load_time) % VIA_DOTS_PER_TICK;
+                /* Free-running interrupts on every underflow */
+                if (new_acr & VIA_ACR_T1_FREERUN)
+                        t1_armed = 1;
+        }
+        if (changed & VIA_ACR_T2_PULSES) {
+                t2_load_val = via_t2_count(now);
+                t2_load_time = now;
+        }
+}
+
+static void via_timer_event(void)
+{
+        via_timers_update(via_now());
+        via_timers_schedule();
+        via_assess_irq();
+}
+
 /* A[12:9] select regs */
 void    via_write(unsigned int address, uint8_t data)
 {
@@ -189,6 +359,9 @@ void    via_write(unsigned int address, uint8_t data)
         VDBG("[VIA: WR %02x -> %s (0x%x)]\n", data, rname, r);
 
         int dowrite = 1;
+        uint64_t now = via_now();
+
+        via_timers_update(now);
         switch (r) {
         case VIA_RA:
         case VIA_RA_ALT:
@@ -206,6 +379,36 @@ void    via_write(unsigned int address, uint8_t data)
                 via_update_sr(data);
                 dowrite = 0;
                 break;
+        case VIA_T1CL:
+                /* Writes the low latch */
+                r = VIA_T1LL;
+                break;
+        case VIA_T1CH:
+                /* Load the counter from the latches, and go: */
+                via_regs[VIA_T1LH] = data;
+                t1_load_val = via_t1_latch();
+                t1_load_time = now;
+                t1_armed = 1;
+                irq_active &= ~VIA_IRQ_T1;
+                break;
+        case VIA_T1LL:
+                break;
+        case VIA_T1LH:
+                irq_active &= ~VIA_IRQ_T1;
+                break;
+        case VIA_T2CL:
+                /* Low latch, kept in via_regs[VIA_T2CL] */
+                break;
+        case VIA_T2CH:
+                t2_load_val = via_regs[VIA_T2CL] | (data << 8);
+                t2_load_time = now;
+                t2_armed = 1;
+                irq_active &= ~VIA_IRQ_T2;
+                dowrite = 0;
+                break;
+        case VIA_ACR:
+                via_timers_rebase(now, data);
+                break;
         case VIA_IER:
                 if (data & 0x80)
                         irq_enable |= data & 0x7f;
@@ -230,6 +433,7 @@ void    via_write(unsigned int address, uint8_t data)
 
         if (dowrite)
                 via_regs[r] = data;
+        via_timers_schedule();
         via_assess_irq();
 }
 
@@ -267,6 +471,31 @@ uint8_t via_read(unsigned int address)
                 data = via_read_rega();
                 break;
 
+        case VIA_T1CL:
+        case VIA_T1CH:
+        case VIA_T2CL:
+        case VIA_T2CH: {
+                uint64_t now = via_now();
+                uint16_t count;
+
+                via_timers_update(now);
+                if (r == VIA_T1CL || r == VIA_T1CH)
+                        count = via_t1_count(now);
+                else
+                        count = via_t2_count(now);
+                data = (r == VIA_T1CL || r == VIA_T2CL) ? (count & 0xff) : (count >> 8);
+                /* Reading the low byte clears the IRQ */
+                if (r == VIA_T1CL)
+                        irq_active &= ~VIA_IRQ_T1;
+                else if (r == VIA_T2CL)
+                        irq_active &= ~VIA_IRQ_T2;
+                via_timers_schedule();
+        } break;
+
+        case VIA_T1LL:
+        case VIA_T1LH:
+                break;
+
         case VIA_RB:
                 data = via_read_regb();
                 break;
@@ -280,6 +509,7 @@ uint8_t via_read(unsigned int address)
                 break;
 
         case VIA_IFR:
+                via_timers_update(via_now());
                 data = via_read_ifr();
                 break;
         default:
@@ -290,21 +520,14 @@ uint8_t via_read(unsigned int address)
         return data;
 }
 
-/* Time param in us */
-void    via_tick(uint64_t time)
-{
-        (void)time;
-        // FIXME: support actual timers.....!
-}
-
 /* External world pipes CA1/CA2 events (passage of time) in here:
  */
 void    via_caX_event(int ca)
 {
         if (ca == 1) {
-                irq_active |= VIA_IRQ_CA;
+                via_ifr_set(VIA_IRQ_CA);
         } else if (ca == 2) {
-                irq_active |= VIA_IRQ_CB;
+                via_ifr_set(VIA_IRQ_CB);
         }
         via_assess_irq();
 }
@@ -317,10 +540,72 @@ void    via_sr_rx(uint8_t val)
         VDBG("[VIAL sr_rx %02x (acr %02x)]\n", val, via_regs[VIA_ACR]);
         if ((via_regs[VIA_ACR] & 0x1c) == 0x0c) {
                 via_regs[VIA_SR] = val;
-                irq_active |= VIA_IRQ_SR;
+                via_ifr_set(VIA_IRQ_SR);
                 VDBG("[VIA sr_rx received, IRQ pending]\n");
                 via_assess_irq();
         } else {
                 VDBG("[VIA ACR SR state %02x, not receiving]\n", via_regs[VIA_ACR]);
         }
 }
+
+/* Per-instance state, see umac_select() */
+struct via_state {
+        uint8_t regs[16];
+        int irq_status;
+        uint8_t irq_active;
+        uint8_t irq_enable;
+        uint8_t irq_last_active;
+        int sr_tx_pending;
+        uint64_t t1_load_time;
+        uint16_t t1_load_val;
+        int t1_armed;
+        uint64_t t2_load_time;
+        uint16_t t2_load_val;
+        int t2_armed;
+};
+
+int     via_irq_status(void)
+{
+        return irq_status;
+}
+
+size_t  via_state_size(void)
+{
+        return sizeof(struct via_state);
+}
+
+void    via_state_save(void *state)
+{
+        struct via_state *s = state;
+
+        memcpy(s->regs, via_regs, sizeof(via_regs));
+        s->irq_status = irq_status;
+        s->irq_active = irq_active;
+        s->irq_enable = irq_enable;
+        s->irq_last_active = irq_last_active;
+        s->sr_tx_pending = sr_tx_pending;
+        s->t1_load_time = t1_load_time;
+        s->t1_load_val = t1_load_val;
+        s->t1_armed = t1_armed;
+        s->t2_load_time = t2_load_time;
+        s->t2_load_val = t2_load_val;
+        s->t2_armed = t2_armed;
+}
+
+void    via_state_load(const void *state)
+{
+        const struct via_state *s = state;
+
+        memcpy(via_regs, s->regs, sizeof(via_regs));
+        irq_status = s->irq_status;
+        irq_active = s->irq_active;
+        irq_enable = s->irq_enable;
+        irq_last_active = s->irq_last_active;
+        sr_tx_pending = s->sr_tx_pending;
+        t1_load_time = s->t1_load_time;
+        t1_load_val = s->t1_load_val;
+        t1_armed = s->t1_armed;
+        t2_load_time = s->t2_load_time;
+        t2_load_val = s->t2_load_val;
+        t2_armed = s->t2_armed;
+}
@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+#
+# Take a list of pairs of Musashi opcode handlers that are often
+# executed back-to-back (see hot_pairs.py), and in-place edit
+# m68kops.c to add fused handlers for them.
+#
+# The fused handler for an opcode runs its usual handler, then peeks
+# at the next opcode: if that's one of the listed successors (and the
+# timeslice isn't over), it runs that straight away, doing what
+# m68k_execute()'s loop would have done in between, rather than going
+# back round the loop and through the jump table.  Only the first
+# handler's entries in the opcode handler table are changed to point
+# at the fused version.  The successor is always called unfused, so
+# the C stack doesn't grow as a chain of pairs is followed.
+#
+# Run after decorate_ops.py; the fused handlers are M68K_FAST_FUNC.
+#
+# Copyright 2024 Matt Evans
+#
+# Permission is hereby granted, free of charge, to any person
+# obtaining a copy of this software and associated documentation files
+# (the "Software"), to deal in the Software without restriction,
+# including without limitation the rights to use, copy, modify, merge,
+# publish, distribute, sublicense, and/or sell copies of the Software,
+# and to permit persons to whom the Software is furnished to do so,
+# subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+# BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+# ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+# CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+import re
+import sys
+
+if len(sys.argv) != 3:
+    print("Syntax: %s <C source> <pair list file>" % (sys.argv[0]))
+    sys.exit(1)
+
+cfile = sys.argv[1]
+pairlistfile = sys.argv[2]
+
+# Read entire C source first:
+clines = []
+
+with open(cfile, 'r') as cf:
+    for l in cf:
+        clines.append(l)
+
+if any(re.search(r'\bm68k_op_\w+_fused\b', l) for l in clines):
+    print("%s already has fused handlers" % (cfile))
+    sys.exit(0)
+
+defined = set()
+table_at = None
+
+for i, l in enumerate(clines):
+    m = re.search(r'^static void (?:M68K_FAST_FUNC\()?(m68k_op_\w+)\)?\(void\)', l)
+    if m:
+        defined.add(m.group(1))
+    if table_at is None and re.search(r'\bm68k_opcode_handler_table\s*\[\s*\]\s*=', l):
+        table_at = i
+
+if table_at is None:
+    print("No handler table found in %s" % (cfile))
+    sys.exit(1)
+
+# Pair list, "<first handler> <second handler>" per line:
+succ = {}
+num = 0
+
+with open(pairlistfile, 'r') as plf:
+    for l in plf:
+        f = l.split('#')[0].split()
+        if len(f) != 2:
+            continue
+        a, b = f
+        if a not in defined or b not in defined:
+            print("Skipping unknown pair %s %s" % (a, b))
+            continue
+        if b not in succ.setdefault(a, []):
+            succ[a].append(b)
+            num += 1
+
+print("Fusing %d pairs, for %d handlers" % (num, len(succ)))
+
+def fused(fname):
+    return "%s_fused" % (fname)
+
+# The loop's work between instructions, cut down to what it is with
+# umac's m68kconf.h.  If that grows prefetch, tracing or address error
+# emulation, fusing is compiled out rather than done approximately.
+out = []
+out.append("""
+/* ======================================================================== */
+/* ============================ FUSED HANDLERS ============================ */
+/* ======================================================================== */
+
+/* Generated by umac's tools/fuse_ops.py */
+
+#if M68K_EMULATE_PREFETCH || M68K_EMULATE_TRACE || M68K_EMULATE_ADDRESS_ERROR
+#define M68KI_FUSE 0
+#else
+#define M68KI_FUSE 1
+#endif
+
+/* Can the next instruction run without going back to m68k_execute()? */
+#define M68KI_FUSE_NEXT() \\
+\t(M68KI_FUSE && GET_CYCLES() > (int)CYC_INSTRUCTION[REG_IR] && !CPU_STOPPED)
+
+/* What m68k_execute() does between instructions: */
+#ifdef REG_DA_SAVE
+#define M68KI_FUSE_DA_SAVE() \\
+\tdo { int i; for(i = 15; i >= 0; i--) REG_DA_SAVE[i] = REG_DA[i]; } while(0)
+#else
+#define M68KI_FUSE_DA_SAVE()
+#endif
+#define M68KI_FUSE_STEP() \\
+\tdo { \\
+\t\tUSE_CYCLES(CYC_INSTRUCTION[REG_IR]); \\
+\t\tm68ki_use_data_space(); \\
+\t\tm68ki_instr_hook(REG_PC); \\
+\t\tREG_PPC = REG_PC; \\
+\t\tM68KI_FUSE_DA_SAVE(); \\
+\t\tREG_IR = m68ki_read_imm_16(); \\
+\t} while(0)
+
+""")
+
+for a in sorted(succ):
+    out.append("static void %s(void)\n" % ("M68K_FAST_FUNC(%s)" % (fused(a))))
+    out.append("{\n")
+    out.append("\t%s();\n" % (a))
+    out.append("\tif(M68KI_FUSE_NEXT())\n")
+    out.append("\t{\n")
+    out.append("\t\tvoid (*next)(void) = m68ki_instruction_jump_table[m68k_read_immediate_16(ADDRESS_68K(REG_PC))];\n\n")
+    first = True
+    for b in succ[a]:
+        # The successor's table entries may themselves be fused:
+        cond = "next == %s" % (b)
+        if b in succ:
+            cond += " || next == %s" % (fused(b))
+        out.append("\t\t%sif(%s)\n" % ("" if first else "else ", cond))
+        out.append("\t\t{\n")
+        out.append("\t\t\tM68KI_FUSE_STEP();\n")
+        out.append("\t\t\t%s();\n" % (b))
+        out.append("\t\t}\n")
+        first = False
+    out.append("\t}\n")
+    out.append("}\n\n")
+
+# Write back out, with the fused handlers just before the table, and
+# the table pointing at them:
+with open(cfile, 'w') as cf:
+    for i, l in enumerate(clines):
+        if i == table_at:
+            cf.write("".join(out))
+        if i > table_at:
+            m = re.search(r'^(\s*\{\s*)(m68k_op_\w+)(\s*,)', l)
+            if m and m.group(2) in succ:
+                l = m.group(1) + fused(m.group(2)) + l[m.end(2):]
+        cf.write(l)
@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+#
+# Turn an opcode histogram (from `main -P <file>`) into a list of the
+# hottest Musashi opcode handlers, suitable for decorate_ops.py.
+#
+# Each opcode is attributed to the handler whose table entry matches
+# it with the most specific mask, which is the handler Musashi ends up
+# installing in its jump table.
+#
+# Copyright 2024 Matt Evans
+#
+# Permission is hereby granted, free of charge, to any person
+# obtaining a copy of this software and associated documentation files
+# (the "Software"), to deal in the Software without restriction,
+# including without limitation the rights to use, copy, modify, merge,
+# publish, distribute, sublicense, and/or sell copies of the Software,
+# and to permit persons to whom the Software is furnished to do so,
+# subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+# BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+# ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+# CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+import re
+import sys
+
+if len(sys.argv) < 3 or len(sys.argv) > 4:
+    print("Syntax: %s <m68kops.c> <opcode histogram> [num fns]" % (sys.argv[0]),
+          file=sys.stderr)
+    sys.exit(1)
+
+cfile = sys.argv[1]
+histfile = sys.argv[2]
+num = int(sys.argv[3]) if len(sys.argv) == 4 else 200
+
+# Handler table entries look like:
+#       {m68k_op_move_8_d_ai         , 0xf1f8, 0x1010, {  8,   8,   4,   4}},
+handlers = []
+
+with open(cfile, 'r') as cf:
+    for l in cf:
+        m = re.search(r'\{\s*(m68k_op_\w+)\s*,\s*0x([0-9a-fA-F]+)\s*,\s*0x([0-9a-fA-F]+)\s*,', l)
+        if m:
+            handlers.append((m.group(1), int(m.group(2), 16), int(m.group(3), 16)))
+
+if not handlers:
+    print("No handler table found in %s" % (cfile), file=sys.stderr)
+    sys.exit(1)
+
+# Most specific mask first; later table entries win ties, as they
+# overwrite earlier ones when Musashi builds its table:
+order = sorted(range(len(handlers)),
+               key=lambda i: (bin(handlers[i][1]).count('1'), i), reverse=True)
+
+counts = {}
+total = 0
+
+with open(histfile, 'r') as hf:
+    for l in hf:
+        f = l.split()
+        if len(f) != 2:
+            continue
+        op = int(f[0], 16)
+        n = int(f[1])
+        total += n
+        for i in order:
+            name, mask, match = handlers[i]
+            if (op & mask) == match:
+                counts[name] = counts.get(name, 0) + n
+                break
+
+hot = sorted(counts.items(), key=lambda c: c[1], reverse=True)[:num]
+covered = sum(c[1] for c in hot)
+
+for name, n in hot:
+    print(name)
+
+print("%d handlers executed; top %d cover %.1f%% of %d instructions" %
+      (len(counts), len(hot), 100.0 * covered / max(total, 1), total),
+      file=sys.stderr)
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+#
+# Turn the opcode pair histogram (from `main -P <file>`) into a list of
+# the hottest pairs of Musashi opcode handlers executed back-to-back,
+# suitable for fuse_ops.py.
+#
+# Opcodes are attributed to handlers as in hot_ops.py.  Pairs whose
+# first handler is a branch/jump aren't useful (the second instruction
+# is only sequential when the branch isn't taken), nor are pairs ending
+# in an instruction that's a poor fit for being called from another
+# handler, so those are skipped.
+#
+# Copyright 2024 Matt Evans
+#
+# Permission is hereby granted, free of charge, to any person
+# obtaining a copy of this software and associated documentation files
+# (the "Software"), to deal in the Software without restriction,
+# including without limitation the rights to use, copy, modify, merge,
+# publish, distribute, sublicense, and/or sell copies of the Software,
+# and to permit persons to whom the Software is furnished to do so,
+# subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+# BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+# ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+# CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+import re
+import sys
+
+if len(sys.argv) < 3 or len(sys.argv) > 4:
+    print("Syntax: %s <m68kops.c> <opcode histogram> [num pairs]" % (sys.argv[0]),
+          file=sys.stderr)
+    sys.exit(1)
+
+cfile = sys.argv[1]
+histfile = sys.argv[2]
+num = int(sys.argv[3]) if len(sys.argv) == 4 else 32
+
+# Handler table entries look like:
+#       {m68k_op_move_8_d_ai         , 0xf1f8, 0x1010, {  8,   8,   4,   4}},
+handlers = []
+
+with open(cfile, 'r') as cf:
+    for l in cf:
+        m = re.search(r'\{\s*(m68k_op_\w+)\s*,\s*0x([0-9a-fA-F]+)\s*,\s*0x([0-9a-fA-F]+)\s*,', l)
+        if m:
+            handlers.append((m.group(1), int(m.group(2), 16), int(m.group(3), 16)))
+
+if not handlers:
+    print("No handler table found in %s" % (cfile), file=sys.stderr)
+    sys.exit(1)
+
+# Most specific mask first; later table entries win ties, as they
+# overwrite earlier ones when Musashi builds its table:
+order = sorted(range(len(handlers)),
+               key=lambda i: (bin(handlers[i][1]).count('1'), i), reverse=True)
+
+op_handler = {}
+
+def handler_for(op):
+    if op not in op_handler:
+        op_handler[op] = None
+        for i in order:
+            name, mask, match = handlers[i]
+            if (op & mask) == match:
+                op_handler[op] = name
+                break
+    return op_handler[op]
+
+# Change of flow first, or things that stop/trap second:
+first_skip = re.compile(r'^m68k_op_(b(hi|ls|cc|cs|ne|eq|vc|vs|pl|mi|ge|lt|gt|le|ra|sr)_|db|jmp|jsr|rt[sedr]|trap|stop|reset|illegal|1010|1111)')
+second_skip = re.compile(r'^m68k_op_(stop|reset|illegal|trap|1010|1111)')
+
+counts = {}
+total = 0
+
+with open(histfile, 'r') as hf:
+    for l in hf:
+        f = l.split()
+        if len(f) != 3:
+            continue
+        a = handler_for(int(f[0], 16))
+        b = handler_for(int(f[1], 16))
+        n = int(f[2])
+        total += n
+        if not a or not b or first_skip.match(a) or second_skip.match(b):
+            continue
+        counts[(a, b)] = counts.get((a, b), 0) + n
+
+hot = sorted(counts.items(), key=lambda c: c[1], reverse=True)[:num]
+covered = sum(c[1] for c in hot)
+
+for (a, b), n in hot:
+    print("%s %s" % (a, b))
+
+print("%d handler pairs executed; top %d cover %.1f%% of %d pairs" %
+      (len(counts), len(hot), 100.0 * covered / max(total, 1), total),
+      file=sys.stderr)
@@ -30,16 +30,36 @@
 #include <inttypes.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <arpa/inet.h> // for ntohl etc.
 
 #define MACVAR_scrnBase         0x824   // u32
 #define MACVAR_scrnXres         0x83a   // u16
 #define MACVAR_scrnYres         0x838   // u16
 
+/* umac's RAM_SWIZZLE builds hold RAM as LE 16-bit words, i.e. Mac byte
+ * address A is at A^1 in the image:
+ */
+static int swizzled = 0;
+
+static uint8_t rd8(uint8_t *base, unsigned int addr)
+{
+	return base[swizzled ? (addr ^ 1) : addr];
+}
+
+static uint16_t rd16(uint8_t *base, unsigned int addr)
+{
+	return (rd8(base, addr) << 8) | rd8(base, addr + 1);
+}
+
+static uint32_t rd32(uint8_t *base, unsigned int addr)
+{
+	return ((uint32_t)rd16(base, addr) << 16) | rd16(base, addr + 2);
+}
+
 static void help(char *me)
 {
-	printf("Syntax: %s [-i] <ram image>\n"
+	printf("Syntax: %s [-i] [-s] <ram image>\n"
 	       "\t-i\tInfer screen base from RAM size (512x342 only)\n"
+	       "\t-s\tRAM image is swizzled (umac RAM_SWIZZLE=1 build)\n"
 	       , me);
 }
 
@@ -52,11 +72,14 @@ int main(int argc, char *argv[])
 	unsigned int xres = 512;
 	unsigned int yres = 342;
 
-        while ((ch = getopt(argc, argv, "hi")) != -1) {
+        while ((ch = getopt(argc, argv, "his")) != -1) {
 		switch (ch) {
 		case 'i':
 			infer = 1;
 			break;
+		case 's':
+			swizzled = 1;
+			break;
 		case 'h':
 		default:
 			help(argv[0]);
@@ -82,7 +105,7 @@ int main(int argc, char *argv[])
                 printf("Can't mmap RAM!\n");
                 return 1;
         }
-        uint8_t *scr_base = ram_base;
+        unsigned int scr_base = 0;
 
 	if (infer) {
 		// Old-style, for fixed 512x342 res
@@ -97,9 +120,9 @@ int main(int argc, char *argv[])
 			scr_base += sb.st_size - 0x5900;
 		}
 	} else {
-		uint32_t mb = ntohl(*(uint32_t *)(ram_base + MACVAR_scrnBase));
-		xres = ntohs(*(uint16_t *)(ram_base + MACVAR_scrnXres));
-		yres = ntohs(*(uint16_t *)(ram_base + MACVAR_scrnYres));
+		uint32_t mb = rd32(ram_base, MACVAR_scrnBase);
+		xres = rd16(ram_base, MACVAR_scrnXres);
+		yres = rd16(ram_base, MACVAR_scrnYres);
 		printf("Read screenbase at %x, %dx%d\n", mb, xres, yres);
 		scr_base += mb;
 	}
@@ -119,8 +142,8 @@ int main(int argc, char *argv[])
         // Output L-R, big-endian shorts, with bits in MSB-LSB order:
         for (int y = 0; y < yres; y++) {
                 for (int x = 0; x < xres; x += 16) {
-                        uint8_t plo = scr_base[x/8 + (y * xres/8) + 0];
-                        uint8_t phi = scr_base[x/8 + (y * xres/8) + 1];
+                        uint8_t plo = rd8(ram_base, scr_base + x/8 + (y * xres/8) + 0);
+                        uint8_t phi = rd8(ram_base, scr_base + x/8 + (y * xres/8) + 1);
                         uint8_t ob = 0;
                         for (int i = 0; i < 8; i++) {
                                 ob |= (plo & (1 << i)) ? (0x80 >> i) : 0;